@@ -0,0 +1,400 @@
+/* Device memory sub-allocator.
+ *
+ * Memory comes from ALLOC_BLOCK_SIZE VkDeviceMemory blocks, one list of blocks
+ * per memory type, and is handed out from each block's free list, first fit.
+ * Host-visible blocks are mapped once for their lifetime; an allocation's map
+ * points at its offset, so callers never map or unmap.
+ *
+ * Buffers (linear) and optimal-tiling images are kept in separate blocks, so
+ * neighbours are always of the same kind and bufferImageGranularity never
+ * needs padding. Requests too large to share a block get a block of their
+ * own. One empty block per list is kept around, further ones are freed.
+ */
+
+#define ALLOC_BLOCK_SIZE (32ull << 20)
+#define ALLOC_DEDICATED_SIZE (ALLOC_BLOCK_SIZE / 2)
+
+struct alloc_range {
+   VkDeviceSize offset, size;
+};
+
+struct alloc_block {
+   struct alloc_block *next;
+   VkDeviceMemory memory;
+   VkDeviceSize size;
+   void *map;
+   uint32_t memory_type;
+   bool optimal;
+
+   /* Free ranges sorted by offset, never adjacent to each other. */
+   struct alloc_range *free;
+   uint32_t free_count, free_capacity;
+   uint32_t allocation_count;
+};
+
+struct allocation {
+   VkDeviceMemory memory;
+   VkDeviceSize offset, size;
+   /* Host address of offset in host-visible memory, else NULL. */
+   void *map;
+   struct alloc_block *block;
+};
+
+struct alloc_stats {
+   uint64_t allocations, frees;
+   /* vkAllocateMemory and vkFreeMemory calls */
+   uint64_t device_allocations, device_frees;
+   uint32_t live_allocations, blocks;
+   VkDeviceSize live_bytes, block_bytes, peak_block_bytes;
+};
+
+struct allocator {
+   VkDevice device;
+   VkPhysicalDeviceMemoryProperties properties;
+   /* [memory type][optimal] */
+   struct alloc_block *blocks[VK_MAX_MEMORY_TYPES][2];
+   struct alloc_stats stats;
+};
+
+static void
+allocator_init(struct allocator *alloc, VkDevice device,
+               const VkPhysicalDeviceMemoryProperties *properties)
+{
+   memset(alloc, 0, sizeof(*alloc));
+   alloc->device = device;
+   alloc->properties = *properties;
+}
+
+/* First memory type allowed by type_bits with all of required, preferring one
+ * that also has preferred. Returns -1 if none has required.
+ */
+static int
+alloc_find_memory_type(const struct allocator *alloc, uint32_t type_bits,
+                       VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred)
+{
+   int found = -1;
+
+   for (uint32_t i = 0; i < alloc->properties.memoryTypeCount; i++) {
+      VkMemoryPropertyFlags flags = alloc->properties.memoryTypes[i].propertyFlags;
+
+      if (!(type_bits & (1u << i)) || (flags & required) != required)
+         continue;
+      if ((flags & preferred) == preferred)
+         return i;
+      if (found < 0)
+         found = i;
+   }
+
+   return found;
+}
+
+static void
+alloc_insert_free(struct alloc_block *block, uint32_t index, VkDeviceSize offset, VkDeviceSize size)
+{
+   if (block->free_count == block->free_capacity) {
+      block->free_capacity = block->free_capacity ? block->free_capacity * 2 : 16;
+      block->free = realloc(block->free, block->free_capacity * sizeof(*block->free));
+      if (!block->free) {
+         fprintf(stderr, "out of memory\n");
+         abort();
+      }
+   }
+
+   memmove(&block->free[index + 1], &block->free[index],
+           (block->free_count - index) * sizeof(*block->free));
+   block->free[index] = (struct alloc_range) { offset, size };
+   block->free_count++;
+}
+
+static void
+alloc_remove_free(struct alloc_block *block, uint32_t index)
+{
+   memmove(&block->free[index], &block->free[index + 1],
+           (block->free_count - index - 1) * sizeof(*block->free));
+   block->free_count--;
+}
+
+/* Carve size bytes at alignment out of the block, or return false. */
+static bool
+alloc_from_block(struct alloc_block *block, VkDeviceSize size, VkDeviceSize alignment,
+                 VkDeviceSize *offset)
+{
+   for (uint32_t i = 0; i < block->free_count; i++) {
+      struct alloc_range range = block->free[i];
+      VkDeviceSize start = (range.offset + alignment - 1) / alignment * alignment;
+      VkDeviceSize end = range.offset + range.size;
+
+      if (start + size > end)
+         continue;
+
+      /* Keep the alignment padding before and the rest after as ranges. */
+      alloc_remove_free(block, i);
+      if (end > start + size)
+         alloc_insert_free(block, i, start + size, end - start - size);
+      if (start > range.offset)
+         alloc_insert_free(block, i, range.offset, start - range.offset);
+
+      *offset = start;
+      return true;
+   }
+
+   return false;
+}
+
+static void
+alloc_return_to_block(struct alloc_block *block, VkDeviceSize offset, VkDeviceSize size)
+{
+   uint32_t lo = 0, hi = block->free_count;
+
+   /* First range after offset. */
+   while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      if (block->free[mid].offset < offset)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   bool merge_prev = lo > 0 &&
+      block->free[lo - 1].offset + block->free[lo - 1].size == offset;
+   bool merge_next = lo < block->free_count &&
+      offset + size == block->free[lo].offset;
+
+   if (merge_prev && merge_next) {
+      block->free[lo - 1].size += size + block->free[lo].size;
+      alloc_remove_free(block, lo);
+   } else if (merge_prev) {
+      block->free[lo - 1].size += size;
+   } else if (merge_next) {
+      block->free[lo].offset = offset;
+      block->free[lo].size += size;
+   } else {
+      alloc_insert_free(block, lo, offset, size);
+   }
+}
+
+static VkResult
+alloc_create_block(struct allocator *alloc, uint32_t memory_type, bool optimal,
+                   VkDeviceSize size, struct alloc_block **out)
+{
+   struct alloc_block *block = calloc(1, sizeof(*block));
+   VkResult result;
+
+   if (!block)
+      return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+   result = vkAllocateMemory(alloc->device,
+                             &(VkMemoryAllocateInfo) {
+                                .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                .allocationSize = size,
+                                .memoryTypeIndex = memory_type,
+                             },
+                             NULL,
+                             &block->memory);
+   if (result != VK_SUCCESS) {
+      free(block);
+      return result;
+   }
+
+   if (alloc->properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      result = vkMapMemory(alloc->device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->map);
+      if (result != VK_SUCCESS) {
+         vkFreeMemory(alloc->device, block->memory, NULL);
+         free(block);
+         return result;
+      }
+   }
+
+   block->size = size;
+   block->memory_type = memory_type;
+   block->optimal = optimal;
+   alloc_insert_free(block, 0, 0, size);
+
+   block->next = alloc->blocks[memory_type][optimal];
+   alloc->blocks[memory_type][optimal] = block;
+
+   alloc->stats.device_allocations++;
+   alloc->stats.blocks++;
+   alloc->stats.block_bytes += size;
+   if (alloc->stats.block_bytes > alloc->stats.peak_block_bytes)
+      alloc->stats.peak_block_bytes = alloc->stats.block_bytes;
+
+   *out = block;
+   return VK_SUCCESS;
+}
+
+static void
+alloc_destroy_block(struct allocator *alloc, struct alloc_block *block)
+{
+   struct alloc_block **link = &alloc->blocks[block->memory_type][block->optimal];
+
+   while (*link != block)
+      link = &(*link)->next;
+   *link = block->next;
+
+   /* Freeing the memory also unmaps it. */
+   vkFreeMemory(alloc->device, block->memory, NULL);
+   alloc->stats.device_frees++;
+   alloc->stats.blocks--;
+   alloc->stats.block_bytes -= block->size;
+
+   free(block->free);
+   free(block);
+}
+
+/* Allocate memory for reqs from a type with the required property flags,
+ * preferring one that also has preferred. optimal is true for images with
+ * optimal tiling.
+ */
+static VkResult
+alloc_memory(struct allocator *alloc, const VkMemoryRequirements *reqs,
+             VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+             bool optimal, struct allocation *out)
+{
+   int memory_type = alloc_find_memory_type(alloc, reqs->memoryTypeBits, required, preferred);
+   struct alloc_block *block = NULL;
+   VkDeviceSize offset = 0;
+   VkResult result;
+
+   if (memory_type < 0)
+      return VK_ERROR_FEATURE_NOT_PRESENT;
+
+   if (reqs->size <= ALLOC_DEDICATED_SIZE) {
+      for (block = alloc->blocks[memory_type][optimal]; block; block = block->next) {
+         if (alloc_from_block(block, reqs->size, reqs->alignment, &offset))
+            break;
+      }
+   }
+
+   if (!block) {
+      VkDeviceSize size = reqs->size > ALLOC_DEDICATED_SIZE ? reqs->size : ALLOC_BLOCK_SIZE;
+
+      result = alloc_create_block(alloc, memory_type, optimal, size, &block);
+      if (result != VK_SUCCESS)
+         return result;
+      alloc_from_block(block, reqs->size, reqs->alignment, &offset);
+   }
+
+   block->allocation_count++;
+
+   *out = (struct allocation) {
+      .memory = block->memory,
+      .offset = offset,
+      .size = reqs->size,
+      .map = block->map ? (char *) block->map + offset : NULL,
+      .block = block,
+   };
+
+   alloc->stats.allocations++;
+   alloc->stats.live_allocations++;
+   alloc->stats.live_bytes += reqs->size;
+
+   return VK_SUCCESS;
+}
+
+static void
+alloc_free(struct allocator *alloc, struct allocation *allocation)
+{
+   struct alloc_block *block = allocation->block;
+
+   if (!block)
+      return;
+
+   alloc_return_to_block(block, allocation->offset, allocation->size);
+   block->allocation_count--;
+
+   alloc->stats.frees++;
+   alloc->stats.live_allocations--;
+   alloc->stats.live_bytes -= allocation->size;
+
+   /* Keep one empty block per list for the next allocation. */
+   if (block->allocation_count == 0) {
+      struct alloc_block *other = alloc->blocks[block->memory_type][block->optimal];
+      bool cached = false;
+
+      for (; other; other = other->next) {
+         if (other != block && other->allocation_count == 0 && other->size == ALLOC_BLOCK_SIZE)
+            cached = true;
+      }
+
+      if (cached || block->size != ALLOC_BLOCK_SIZE)
+         alloc_destroy_block(alloc, block);
+   }
+
+   memset(allocation, 0, sizeof(*allocation));
+}
+
+static void
+allocator_finish(struct allocator *alloc)
+{
+   for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+      for (int optimal = 0; optimal < 2; optimal++) {
+         while (alloc->blocks[i][optimal])
+            alloc_destroy_block(alloc, alloc->blocks[i][optimal]);
+      }
+   }
+}
+
+static void
+allocator_print_stats(const struct allocator *alloc)
+{
+   const struct alloc_stats *s = &alloc->stats;
+
+   printf("device memory: %u allocations, %.1f MiB in %u blocks (%.1f MiB, peak %.1f MiB), "
+          "%lu vkAllocateMemory calls for %lu allocations\n",
+          s->live_allocations, s->live_bytes / 1048576.0, s->blocks,
+          s->block_bytes / 1048576.0, s->peak_block_bytes / 1048576.0,
+          (unsigned long) s->device_allocations, (unsigned long) s->allocations);
+}
+
+/* Linear arena over a persistently mapped range of a buffer: arena_alloc()
+ * hands out space front to back and arena_reset() releases all of it at once.
+ * Neither calls the driver, the caller resets an arena only once the GPU is
+ * done with everything allocated from it.
+ */
+struct arena {
+   VkBuffer buffer;
+   /* range of the buffer and its host address */
+   VkDeviceSize base, size;
+   char *map;
+   /* bytes used since the last reset and the most ever used */
+   VkDeviceSize used, high_water;
+};
+
+static void
+arena_init(struct arena *arena, VkBuffer buffer, const struct allocation *allocation,
+           VkDeviceSize base, VkDeviceSize size)
+{
+   memset(arena, 0, sizeof(*arena));
+   arena->buffer = buffer;
+   arena->base = base;
+   arena->size = size;
+   arena->map = (char *) allocation->map + base;
+}
+
+/* Reserve size bytes aligned to alignment, a power of two, within the buffer.
+ * Returns their host address and their offset into the buffer in *offset, or
+ * NULL if the arena is full.
+ */
+static inline void *
+arena_alloc(struct arena *arena, VkDeviceSize size, VkDeviceSize alignment,
+            VkDeviceSize *offset)
+{
+   VkDeviceSize start = (arena->base + arena->used + alignment - 1) & ~(alignment - 1);
+
+   if (start + size > arena->base + arena->size)
+      return NULL;
+
+   arena->used = start + size - arena->base;
+   if (arena->used > arena->high_water)
+      arena->high_water = arena->used;
+
+   *offset = start;
+   return arena->map + (start - arena->base);
+}
+
+static inline void
+arena_reset(struct arena *arena)
+{
+   arena->used = 0;
+}
@@ -0,0 +1,186 @@
+/* Frame timing collection for --bench.
+ *
+ * Every metric keeps one sample per measured frame in milliseconds. The
+ * report prints min/mean/p50/p95/p99/max/stddev per metric as text, followed
+ * by the same numbers as a single JSON line prefixed with "BENCH " so runs can
+ * be collected and compared across builds. The stddev of "frame", the time
+ * between consecutive frame starts, is the frame pacing jitter.
+ */
+
+#define BENCH_WARMUP_FRAMES 10
+
+enum bench_metric {
+   BENCH_FRAME,
+   BENCH_CPU,
+   BENCH_UPDATE,
+   BENCH_FENCE,
+   BENCH_GPU,
+   BENCH_ACQUIRE,
+   BENCH_PRESENT,
+   BENCH_METRIC_COUNT
+};
+
+static const char *const bench_metric_names[BENCH_METRIC_COUNT] = {
+   [BENCH_FRAME] = "frame",
+   [BENCH_CPU] = "cpu_record",
+   [BENCH_UPDATE] = "cpu_update",
+   [BENCH_FENCE] = "submit_to_fence",
+   [BENCH_GPU] = "gpu",
+   [BENCH_ACQUIRE] = "acquire",
+   [BENCH_PRESENT] = "present",
+};
+
+struct bench_series {
+   double *samples;
+   uint32_t count, capacity;
+};
+
+struct bench {
+   bool enabled;
+
+   /* Stop after this many measured frames, or after this many seconds. */
+   uint32_t frames;
+   double seconds;
+
+   uint32_t submitted, measured;
+   uint64_t start_ns, end_ns;
+   struct bench_series series[BENCH_METRIC_COUNT];
+};
+
+/* Count a frame starting at now. Returns whether its samples are measured,
+ * i.e. benchmarking is enabled and the frame is past the warm-up.
+ */
+static bool
+bench_frame(struct bench *bench, uint64_t now)
+{
+   if (!bench->enabled)
+      return false;
+
+   bench->submitted++;
+   if (bench->submitted <= BENCH_WARMUP_FRAMES)
+      return false;
+
+   if (bench->start_ns == 0)
+      bench->start_ns = now;
+   bench->end_ns = now;
+   bench->measured++;
+
+   return true;
+}
+
+static bool
+bench_done(struct bench *bench)
+{
+   if (!bench->enabled)
+      return false;
+
+   if (bench->frames > 0)
+      return bench->measured >= bench->frames;
+
+   return bench->start_ns != 0 &&
+          (bench->end_ns - bench->start_ns) / 1e9 >= bench->seconds;
+}
+
+static void
+bench_add(struct bench *bench, enum bench_metric metric, uint64_t ns)
+{
+   struct bench_series *series = &bench->series[metric];
+
+   if (series->count == series->capacity) {
+      series->capacity = series->capacity ? series->capacity * 2 : 1024;
+      series->samples = realloc(series->samples, series->capacity * sizeof(double));
+      if (!series->samples) {
+         fprintf(stderr, "out of memory\n");
+         abort();
+      }
+   }
+
+   series->samples[series->count++] = ns / 1e6;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a, y = *(const double *) b;
+
+   return (x > y) - (x < y);
+}
+
+struct bench_summary {
+   double min, mean, p50, p95, p99, max, stddev;
+};
+
+/* Nearest-rank percentile of sorted samples. */
+static double
+percentile(const double *sorted, uint32_t count, double p)
+{
+   uint32_t rank = (uint32_t) ceil(p / 100.0 * count);
+
+   return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static struct bench_summary
+bench_summarize(struct bench_series *series)
+{
+   struct bench_summary s = { 0 };
+   double sum = 0.0;
+
+   qsort(series->samples, series->count, sizeof(double), compare_double);
+   for (uint32_t i = 0; i < series->count; i++)
+      sum += series->samples[i];
+
+   s.min = series->samples[0];
+   s.max = series->samples[series->count - 1];
+   s.mean = sum / series->count;
+   s.p50 = percentile(series->samples, series->count, 50.0);
+   s.p95 = percentile(series->samples, series->count, 95.0);
+   s.p99 = percentile(series->samples, series->count, 99.0);
+
+   double variance = 0.0;
+   for (uint32_t i = 0; i < series->count; i++)
+      variance += (series->samples[i] - s.mean) * (series->samples[i] - s.mean);
+   s.stddev = sqrt(variance / series->count);
+
+   return s;
+}
+
+/* Print the report. config is a list of JSON members describing the run,
+ * e.g. "\"mode\":\"xcb\"", copied verbatim into the JSON line.
+ */
+static void
+bench_report(struct bench *bench, const char *config)
+{
+   struct bench_summary summary[BENCH_METRIC_COUNT];
+   uint32_t frames = bench->measured;
+   double seconds = (bench->end_ns - bench->start_ns) / 1e9;
+   /* start and end are the first and last frame's start */
+   double fps = seconds > 0.0 ? (frames - 1) / seconds : 0.0;
+
+   printf("\nbenchmark: %u frames in %.3f s, %.1f fps\n", frames, seconds, fps);
+   printf("%-16s %9s %9s %9s %9s %9s %9s %9s (ms)\n",
+          "metric", "min", "mean", "p50", "p95", "p99", "max", "stddev");
+
+   for (int m = 0; m < BENCH_METRIC_COUNT; m++) {
+      if (bench->series[m].count == 0)
+         continue;
+
+      struct bench_summary *s = &summary[m];
+      *s = bench_summarize(&bench->series[m]);
+      printf("%-16s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+             bench_metric_names[m], s->min, s->mean, s->p50, s->p95, s->p99, s->max, s->stddev);
+   }
+
+   printf("BENCH {%s,\"frames\":%u,\"seconds\":%.6f,\"fps\":%.3f",
+          config, frames, seconds, fps);
+   for (int m = 0; m < BENCH_METRIC_COUNT; m++) {
+      if (bench->series[m].count == 0)
+         continue;
+
+      struct bench_summary *s = &summary[m];
+      printf(",\"%s_ms\":{\"min\":%.6f,\"mean\":%.6f,\"p50\":%.6f,"
+             "\"p95\":%.6f,\"p99\":%.6f,\"max\":%.6f,\"stddev\":%.6f}",
+             bench_metric_names[m], s->min, s->mean, s->p50, s->p95, s->p99, s->max, s->stddev);
+   }
+   printf("}\n");
+   fflush(stdout);
+}
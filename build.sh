@@ -1,4 +1,4 @@
 clear
 echo "COMPILATION BEGIN"
-gcc main.c -lxcb -lvulkan -lm -o hello_x
+gcc ${CFLAGS:--O2} main.c -lxcb -lvulkan -lpng -lm -lpthread -o hello_x
 echo "COMPILATION END"
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <linux/kd.h>
 #include <linux/vt.h>
@@ -23,31 +24,231 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_xcb.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <png.h>
+#include <stddef.h>
+#include "workers.h"
+#include "alloc.h"
 
 #define MAX_NUM_IMAGES 5
+#define MAX_FRAMES_IN_FLIGHT 3
+/* Frame arena space beyond what the UBO and instances need. */
+#define FRAME_ARENA_HEADROOM (64 << 10)
 
 static uint32_t vs_spirv_source[] = {
 #include "vert.spv.shad"
 };
 
+/* vert.spv with the UBO matrices replaced by per-instance vertex attributes
+ * at locations 3-6 (modelview), 7-10 (modelviewprojection) and 11-13
+ * (normalMatrix), laid out like struct ubo.
+ */
+static uint32_t vs_instanced_spirv_source[] = {
+#include "vert_instanced.spv.shad"
+};
+
 static uint32_t fs_spirv_source[] = {
 #include "frag.spv.shad"
 };
 
 
+/* Matrix kernels are picked at compile time: AVX handles two rows per
+ * instruction, SSE2 and NEON one, anything else uses the scalar code. FMA is
+ * used when enabled, e.g. with -mavx2 -mfma or -march=native.
+ */
+#if defined(__AVX__)
+#include <immintrin.h>
+#if defined(__FMA__)
+#define ES_MATRIX_SIMD "avx+fma"
+#else
+#define ES_MATRIX_SIMD "avx"
+#endif
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define ES_MATRIX_SIMD "sse2"
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ES_MATRIX_SIMD "neon"
+#else
+#define ES_MATRIX_SIMD "scalar"
+#endif
+
+#if defined(__FMA__)
+#define ES_MADD128(a, b, c) _mm_fmadd_ps(a, b, c)
+#define ES_MADD256(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define ES_MADD128(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define ES_MADD256(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+
+/* Aligned so every row is one SSE/NEON register. */
 typedef struct
 {
     float   m[4][4];
-} ESMatrix;
+} __attribute__((aligned(16))) ESMatrix;
 
 #include <math.h>
 #include <string.h>
 
 #define PI 3.1415926535897932384626433832795f
 
+/* The original scalar multiply, kept as the fallback and as the baseline for
+ * --bench-matrix.
+ */
+void
+esMatrixMultiplyScalar(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB)
+{
+    ESMatrix    tmp;
+    int         i;
+
+	for (i=0; i<4; i++)
+	{
+		tmp.m[i][0] =	(srcA->m[i][0] * srcB->m[0][0]) +
+						(srcA->m[i][1] * srcB->m[1][0]) +
+						(srcA->m[i][2] * srcB->m[2][0]) +
+						(srcA->m[i][3] * srcB->m[3][0]) ;
+
+		tmp.m[i][1] =	(srcA->m[i][0] * srcB->m[0][1]) + 
+						(srcA->m[i][1] * srcB->m[1][1]) +
+						(srcA->m[i][2] * srcB->m[2][1]) +
+						(srcA->m[i][3] * srcB->m[3][1]) ;
+
+		tmp.m[i][2] =	(srcA->m[i][0] * srcB->m[0][2]) + 
+						(srcA->m[i][1] * srcB->m[1][2]) +
+						(srcA->m[i][2] * srcB->m[2][2]) +
+						(srcA->m[i][3] * srcB->m[3][2]) ;
+
+		tmp.m[i][3] =	(srcA->m[i][0] * srcB->m[0][3]) + 
+						(srcA->m[i][1] * srcB->m[1][3]) +
+						(srcA->m[i][2] * srcB->m[2][3]) +
+						(srcA->m[i][3] * srcB->m[3][3]) ;
+	}
+    memcpy(result, &tmp, sizeof(ESMatrix));
+}
+
+
+/* Right-hand operand of a multiply, loaded into registers once so batches
+ * sharing it skip the reloads.
+ */
+typedef struct
+{
+#if defined(__AVX__)
+    __m256      r[4];   /* each row in both 128 bit lanes */
+#elif defined(__SSE2__)
+    __m128      r[4];
+#elif defined(__ARM_NEON)
+    float32x4_t r[4];
+#else
+    ESMatrix    m;
+#endif
+} ESMatrixRows;
+
+static inline void
+esLoadRows(ESMatrixRows *rows, const ESMatrix *src)
+{
+#if defined(__AVX__)
+    for (int i = 0; i < 4; i++)
+        rows->r[i] = _mm256_broadcast_ps((const __m128 *) src->m[i]);
+#elif defined(__SSE2__)
+    for (int i = 0; i < 4; i++)
+        rows->r[i] = _mm_load_ps(src->m[i]);
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < 4; i++)
+        rows->r[i] = vld1q_f32(src->m[i]);
+#else
+    rows->m = *src;
+#endif
+}
+
+/* result = srcA * rows. Row i of the result only depends on row i of srcA,
+ * which is read before it is written, so result may alias srcA.
+ */
+static inline void
+esMultiplyRows(ESMatrix *result, const ESMatrix *srcA, const ESMatrixRows *rows)
+{
+#if defined(__AVX__)
+    for (int i = 0; i < 4; i += 2)
+    {
+        __m256 a = _mm256_loadu_ps(srcA->m[i]);
+        __m256 r = _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x00), rows->r[0]);
+        r = ES_MADD256(_mm256_shuffle_ps(a, a, 0x55), rows->r[1], r);
+        r = ES_MADD256(_mm256_shuffle_ps(a, a, 0xaa), rows->r[2], r);
+        r = ES_MADD256(_mm256_shuffle_ps(a, a, 0xff), rows->r[3], r);
+        _mm256_storeu_ps(result->m[i], r);
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < 4; i++)
+    {
+        __m128 a = _mm_load_ps(srcA->m[i]);
+        __m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), rows->r[0]);
+        r = ES_MADD128(_mm_shuffle_ps(a, a, 0x55), rows->r[1], r);
+        r = ES_MADD128(_mm_shuffle_ps(a, a, 0xaa), rows->r[2], r);
+        r = ES_MADD128(_mm_shuffle_ps(a, a, 0xff), rows->r[3], r);
+        _mm_store_ps(result->m[i], r);
+    }
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < 4; i++)
+    {
+        float32x4_t a = vld1q_f32(srcA->m[i]);
+        float32x4_t r = vmulq_n_f32(rows->r[0], vgetq_lane_f32(a, 0));
+        r = vmlaq_n_f32(r, rows->r[1], vgetq_lane_f32(a, 1));
+        r = vmlaq_n_f32(r, rows->r[2], vgetq_lane_f32(a, 2));
+        r = vmlaq_n_f32(r, rows->r[3], vgetq_lane_f32(a, 3));
+        vst1q_f32(result->m[i], r);
+    }
+#else
+    esMatrixMultiplyScalar(result, srcA, &rows->m);
+#endif
+}
+
+void
+esMatrixMultiply(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB)
+{
+    ESMatrixRows rows;
+
+    esLoadRows(&rows, srcB);
+    esMultiplyRows(result, srcA, &rows);
+}
+
+/* result[i] = srcA[i] * srcB[i] for count matrices. */
+void
+esMatrixMultiplyBatch(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, size_t count)
+{
+    ESMatrixRows rows;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        esLoadRows(&rows, &srcB[i]);
+        esMultiplyRows(&result[i], &srcA[i], &rows);
+    }
+}
+
+/* result[i] = srcA[i] * srcB for count matrices, e.g. modelviews times one
+ * projection.
+ */
+void
+esMatrixMultiplyBatchShared(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, size_t count)
+{
+    ESMatrixRows rows;
+
+    esLoadRows(&rows, srcB);
+    for (size_t i = 0; i < count; i++)
+        esMultiplyRows(&result[i], &srcA[i], &rows);
+}
+
 void
 esScale(ESMatrix *result, float sx, float sy, float sz)
 {
+#if defined(__SSE2__)
+    _mm_store_ps(result->m[0], _mm_mul_ps(_mm_load_ps(result->m[0]), _mm_set1_ps(sx)));
+    _mm_store_ps(result->m[1], _mm_mul_ps(_mm_load_ps(result->m[1]), _mm_set1_ps(sy)));
+    _mm_store_ps(result->m[2], _mm_mul_ps(_mm_load_ps(result->m[2]), _mm_set1_ps(sz)));
+#elif defined(__ARM_NEON)
+    vst1q_f32(result->m[0], vmulq_n_f32(vld1q_f32(result->m[0]), sx));
+    vst1q_f32(result->m[1], vmulq_n_f32(vld1q_f32(result->m[1]), sy));
+    vst1q_f32(result->m[2], vmulq_n_f32(vld1q_f32(result->m[2]), sz));
+#else
     result->m[0][0] *= sx;
     result->m[0][1] *= sx;
     result->m[0][2] *= sx;
@@ -62,15 +263,30 @@ esScale(ESMatrix *result, float sx, float sy, float sz)
     result->m[2][1] *= sz;
     result->m[2][2] *= sz;
     result->m[2][3] *= sz;
+#endif
 }
 
 void
 esTranslate(ESMatrix *result, float tx, float ty, float tz)
 {
+#if defined(__SSE2__)
+    __m128 r = _mm_load_ps(result->m[3]);
+    r = ES_MADD128(_mm_load_ps(result->m[0]), _mm_set1_ps(tx), r);
+    r = ES_MADD128(_mm_load_ps(result->m[1]), _mm_set1_ps(ty), r);
+    r = ES_MADD128(_mm_load_ps(result->m[2]), _mm_set1_ps(tz), r);
+    _mm_store_ps(result->m[3], r);
+#elif defined(__ARM_NEON)
+    float32x4_t r = vld1q_f32(result->m[3]);
+    r = vmlaq_n_f32(r, vld1q_f32(result->m[0]), tx);
+    r = vmlaq_n_f32(r, vld1q_f32(result->m[1]), ty);
+    r = vmlaq_n_f32(r, vld1q_f32(result->m[2]), tz);
+    vst1q_f32(result->m[3], r);
+#else
     result->m[3][0] += (result->m[0][0] * tx + result->m[1][0] * ty + result->m[2][0] * tz);
     result->m[3][1] += (result->m[0][1] * tx + result->m[1][1] * ty + result->m[2][1] * tz);
     result->m[3][2] += (result->m[0][2] * tx + result->m[1][2] * ty + result->m[2][2] * tz);
     result->m[3][3] += (result->m[0][3] * tx + result->m[1][3] * ty + result->m[2][3] * tz);
+#endif
 }
 
 void
@@ -190,38 +406,6 @@ esOrtho(ESMatrix *result, float left, float right, float bottom, float top, floa
 }
 
 
-void
-esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
-{
-    ESMatrix    tmp;
-    int         i;
-
-	for (i=0; i<4; i++)
-	{
-		tmp.m[i][0] =	(srcA->m[i][0] * srcB->m[0][0]) +
-						(srcA->m[i][1] * srcB->m[1][0]) +
-						(srcA->m[i][2] * srcB->m[2][0]) +
-						(srcA->m[i][3] * srcB->m[3][0]) ;
-
-		tmp.m[i][1] =	(srcA->m[i][0] * srcB->m[0][1]) + 
-						(srcA->m[i][1] * srcB->m[1][1]) +
-						(srcA->m[i][2] * srcB->m[2][1]) +
-						(srcA->m[i][3] * srcB->m[3][1]) ;
-
-		tmp.m[i][2] =	(srcA->m[i][0] * srcB->m[0][2]) + 
-						(srcA->m[i][1] * srcB->m[1][2]) +
-						(srcA->m[i][2] * srcB->m[2][2]) +
-						(srcA->m[i][3] * srcB->m[3][2]) ;
-
-		tmp.m[i][3] =	(srcA->m[i][0] * srcB->m[0][3]) + 
-						(srcA->m[i][1] * srcB->m[1][3]) +
-						(srcA->m[i][2] * srcB->m[2][3]) +
-						(srcA->m[i][3] * srcB->m[3][3]) ;
-	}
-    memcpy(result, &tmp, sizeof(ESMatrix));
-}
-
-
 void
 esMatrixLoadIdentity(ESMatrix *result)
 {
@@ -239,27 +423,118 @@ struct ubo {
    float normal[12];
 };
 
+#include "transform.h"
+
+/* How vertex attributes are laid out in the vertex buffer. SEPARATE uses one
+ * binding per attribute, the others a single binding with all attributes of
+ * a vertex next to each other.
+ */
+enum vertex_layout {
+   VERTEX_LAYOUT_SEPARATE,
+   VERTEX_LAYOUT_INTERLEAVED,
+   VERTEX_LAYOUT_PACKED,
+};
+
+static const char *const vertex_layout_names[] = {
+   [VERTEX_LAYOUT_SEPARATE] = "separate",
+   [VERTEX_LAYOUT_INTERLEAVED] = "interleaved",
+   [VERTEX_LAYOUT_PACKED] = "packed",
+};
+
+struct vertex_interleaved {
+   float position[3];
+   float color[3];
+   float normal[3];
+};
+
+#include "mesh.h"
+#include "meshopt.h"
+
+/* Color as RGBA8 UNORM, normal as RGBA8 SNORM with w unused: 20 bytes. */
+struct vertex_packed {
+   float position[3];
+   uint8_t color[4];
+   int8_t normal[4];
+};
+
 struct vkcube;
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 static inline bool
 streq(const char *a, const char *b)
 {
    return strcmp(a, b) == 0;
 }
 
+static inline uint64_t
+get_time_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 struct vkcube_buffer {
    struct gbm_bo *gbm_bo;
-   VkDeviceMemory mem;
+   /* headless only, the swapchain owns its images */
+   struct allocation image_alloc;
    VkImage image;
    VkImageView view;
    VkFramebuffer framebuffer;
+   /* --grid only */
+   VkImage depth_image;
+   struct allocation depth_alloc;
+   VkImageView depth_view;
+   /* Fence of the frame that last rendered into this buffer, not owned. */
    VkFence fence;
-   VkCommandBuffer cmd_buffer;
+   /* Swapchain only: signaled by the frame's commands, waited on by the
+    * present. One per image rather than per frame slot, as the presentation
+    * engine holds on to it until the image is acquired again.
+    */
+   VkSemaphore render_semaphore;
+   /* One set of commands per frame slot, as the slot's arena offsets are
+    * recorded into them. --record-threads: one secondary per recording
+    * thread.
+    */
+   VkCommandBuffer cmd_buffers[MAX_FRAMES_IN_FLIGHT];
+   VkCommandBuffer secondary[MAX_FRAMES_IN_FLIGHT][MAX_WORKERS];
+
+   /* Headless only: host-visible copy of the image and the number of the
+    * frame it holds once the fence signals, or -1.
+    */
+   VkBuffer readback;
+   struct allocation readback_alloc;
+   int64_t readback_frame;
 
    uint32_t fb;
    uint32_t stride;
 };
 
+/* Per frame-in-flight synchronization. The CPU may record up to
+ * vc->frames_in_flight frames ahead of the GPU, each with its own acquire
+ * semaphore and fence.
+ */
+struct vkcube_frame {
+   VkSemaphore acquire_semaphore;
+   VkFence fence;
+
+   /* buffer rendered by the frame, holding its GPU timestamps */
+   struct vkcube_buffer *buffer;
+
+   /* the frame's UBO and instance data, reset once the fence signals */
+   struct arena arena;
+   /* where the UBO and instances are in the arena, the same every frame */
+   VkDeviceSize ubo_offset, instance_offset;
+
+   uint64_t start_ns;
+   uint64_t cpu_ns;
+   uint64_t update_ns;
+   uint64_t submit_ns;
+   bool measured;
+};
+
 struct model {
    void (*init)(struct vkcube *vc);
    void (*render)(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore);
@@ -277,8 +552,12 @@ struct vkcube
 	struct {
 		xcb_connection_t *conn;
 		xcb_window_t window;
+		xcb_visualid_t visual;
 		xcb_atom_t atom_wm_protocols;
 		xcb_atom_t atom_wm_delete_window;
+		bool mapped;
+		/* VisibilityNotify said fully obscured */
+		bool obscured;
 	} xcb;
 
 	struct {
@@ -286,6 +565,10 @@ struct vkcube
 	} khr;
 
 	VkSwapchainKHR swap_chain;
+	/* The window changed size or the swapchain went out of date, recreate
+	 * it before the next frame.
+	 */
+	bool swap_chain_stale;
 
 	//    drmModeCrtc *crtc;
 	//    drmModeConnector *connector;
@@ -293,20 +576,108 @@ struct vkcube
 
 	VkInstance instance;
 	VkPhysicalDevice physical_device;
+	/* Graphics family. Presentation and uploads use their own families
+	 * and queues where the device has suitable ones, otherwise these equal
+	 * queue_family and queue.
+	 */
+	uint32_t queue_family;
+	uint32_t present_family;
+	uint32_t transfer_family;
+	VkPhysicalDeviceProperties properties;
 	VkPhysicalDeviceMemoryProperties memory_properties;
 	VkDevice device;
 	VkRenderPass render_pass;
 	VkQueue queue;
+	VkQueue present_queue;
+	VkQueue transfer_queue;
+	VkDescriptorSetLayout set_layout;
 	VkPipelineLayout pipeline_layout;
 	VkPipeline pipeline;
-	VkDeviceMemory mem;
-	VkBuffer buffer;
+	/* all buffer and image memory */
+	struct allocator allocator;
+	/* Backs every frame's arena, frame_arena_size bytes each. */
+	VkBuffer frame_buffer;
+	struct allocation frame_alloc;
+	VkDeviceSize frame_arena_size;
+	VkDescriptorPool descriptor_pool;
 	VkDescriptorSet descriptor_set;
-	VkSemaphore semaphore;
 	VkCommandPool cmd_pool;
-
-	void *map;
+	/* VK_NULL_HANDLE unless transfer_family has its own queue */
+	VkCommandPool transfer_cmd_pool;
+
+	struct vkcube_frame frames[MAX_FRAMES_IN_FLIGHT];
+	uint32_t frames_in_flight;
+	uint32_t frame_index;
+
+	/* Record each buffer's commands once per swapchain instead of per frame. */
+	bool prerecord;
+
+	/* --present-mode (-1 prefers MAILBOX, falling back to FIFO) and the mode
+	 * the swapchain was created with; --swap-images, 0 for the default of 2.
+	 */
+	int requested_present_mode;
+	VkPresentModeKHR present_mode;
+	uint32_t swap_image_count;
+	/* --fps-limit, 0 for none */
+	uint32_t fps_limit;
+
+	/* Two timestamps per buffer around its render pass, or VK_NULL_HANDLE
+	 * if the queue does not support timestamps.
+	 */
+	VkQueryPool query_pool;
+	uint32_t timestamp_valid_bits;
+
+	/* Pipeline cache persisted under $XDG_CACHE_HOME, and whether its data
+	 * was valid for this device when loaded.
+	 */
+	bool use_pipeline_cache;
+	VkPipelineCache pipeline_cache;
+	bool pipeline_cache_warm;
+	uint64_t pipeline_ns;
+
+	/* --grid: grid^3 instances whose struct ubo matrices are written to
+	 * the frame arena every frame.
+	 */
+	uint32_t grid;
+	uint32_t instance_count;
+	/* per-instance transform inputs and the threads updating them */
+	struct transform_batch instances;
+	float *instance_phase;
+	uint32_t update_threads;
+	struct worker_pool update_pool;
+	/* VK_FORMAT_UNDEFINED unless objects may overlap each other or
+	 * themselves.
+	 */
+	VkFormat depth_format;
+
+	/* --separate-draws: one draw per object instead of one instanced draw */
+	bool separate_draws;
+
+	/* --record-threads: render pass contents are recorded into secondary
+	 * command buffers by record_pool, each thread using its own pool.
+	 * record_pool.count is 0 when recording inline.
+	 */
+	uint32_t record_threads;
+	struct worker_pool record_pool;
+	VkCommandPool record_cmd_pools[MAX_WORKERS];
+
+	/* Static geometry, the cube or --mesh, device-local unless
+	 * host_vertices is set.
+	 */
+	const char *mesh_path;
+	/* --mesh-optimize and the ACMR of the mesh as uploaded */
+	enum mesh_optimize mesh_optimize;
+	float mesh_acmr;
+	bool host_vertices;
+	enum vertex_layout vertex_layout;
+	VkBuffer vertex_buffer;
+	struct allocation vertex_alloc;
+	uint32_t vertex_count;
 	uint32_t vertex_offset, colors_offset, normals_offset;
+	VkBuffer index_buffer;
+	struct allocation index_alloc;
+	VkIndexType index_type;
+	uint32_t index_count;
 
 	struct timeval start_tv;
 	VkSurfaceKHR surface;
@@ -316,30 +687,584 @@ struct vkcube
 	int current;
 };
 
-static int find_host_coherent_memory(struct vkcube *vc, unsigned allowed)
+/* Create a buffer and sub-allocate its memory, host-coherent and mapped
+ * (allocation->map) or device-local.
+ */
+static void
+create_buffer(struct vkcube *vc, VkDeviceSize size, VkBufferUsageFlags usage,
+              bool host_visible, VkBuffer *buffer, struct allocation *allocation)
 {
-    for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) {
-        if ((allowed & (1u << i)) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-            return i;
-    }
-    return -1;
+   VkMemoryRequirements reqs;
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = size,
+                     .usage = usage,
+                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                  },
+                  NULL,
+                  buffer);
+
+   vkGetBufferMemoryRequirements(vc->device, *buffer, &reqs);
+
+   VkMemoryPropertyFlags required = host_visible ?
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT :
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+   if (alloc_memory(&vc->allocator, &reqs, required, 0, false, allocation) != VK_SUCCESS) {
+      fprintf(stderr, "no suitable memory for a %lu byte buffer\n", (unsigned long) size);
+      exit(1);
+   }
+
+   vkBindBufferMemory(vc->device, *buffer, allocation->memory, allocation->offset);
+}
+
+/* Create a buffer holding data that never changes. It is placed in
+ * device-local memory and filled from a staging buffer by a one-time
+ * transfer, or with vc->host_vertices written directly into host-coherent
+ * memory, which on discrete GPUs is read across the bus on every use.
+ *
+ * With a separate transfer family the copy runs on the transfer queue,
+ * leaving the graphics queue free. The buffer is exclusive to one family, so
+ * the transfer queue then releases it and the graphics queue acquires it,
+ * ordered by a semaphore.
+ */
+static void
+create_static_buffer(struct vkcube *vc, VkBufferUsageFlags usage,
+                     const void *data, VkDeviceSize size,
+                     VkBuffer *buffer, struct allocation *allocation)
+{
+   if (vc->host_vertices) {
+      create_buffer(vc, size, usage, true, buffer, allocation);
+      memcpy(allocation->map, data, size);
+      return;
+   }
+
+   VkBuffer staging;
+   struct allocation staging_alloc;
+   create_buffer(vc, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, true, &staging, &staging_alloc);
+   memcpy(staging_alloc.map, data, size);
+
+   create_buffer(vc, size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, false, buffer, allocation);
+
+   bool transfer_queue = vc->transfer_family != vc->queue_family;
+   VkCommandPool pool = transfer_queue ? vc->transfer_cmd_pool : vc->cmd_pool;
+
+   /* [0] copies, on the transfer queue if there is one, [1] acquires the
+    * buffer on the graphics queue.
+    */
+   VkCommandBuffer cmd_buffers[2];
+   vkAllocateCommandBuffers(vc->device,
+                            &(VkCommandBufferAllocateInfo) {
+                               .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                               .commandPool = pool,
+                               .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                               .commandBufferCount = 1,
+                            },
+                            &cmd_buffers[0]);
+
+   vkBeginCommandBuffer(cmd_buffers[0],
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+                        });
+
+   vkCmdCopyBuffer(cmd_buffers[0], staging, *buffer, 1,
+                   &(VkBufferCopy) { .srcOffset = 0, .dstOffset = 0, .size = size });
+
+   VkBufferMemoryBarrier ownership = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT,
+      .srcQueueFamilyIndex = vc->transfer_family,
+      .dstQueueFamilyIndex = vc->queue_family,
+      .buffer = *buffer,
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+   };
+
+   if (transfer_queue) {
+      /* Release: the destination access is done by the acquire. */
+      VkBufferMemoryBarrier release = ownership;
+      release.dstAccessMask = 0;
+      vkCmdPipelineBarrier(cmd_buffers[0],
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0, 0, NULL, 1, &release, 0, NULL);
+   } else {
+      /* Make the copy visible to every later submission reading the buffer. */
+      vkCmdPipelineBarrier(cmd_buffers[0],
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           0,
+                           1, &(VkMemoryBarrier) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                              .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                              .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                               VK_ACCESS_INDEX_READ_BIT,
+                           },
+                           0, NULL,
+                           0, NULL);
+   }
+
+   vkEndCommandBuffer(cmd_buffers[0]);
+
+   VkFence fence;
+   vkCreateFence(vc->device,
+                 &(VkFenceCreateInfo) { .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO },
+                 NULL,
+                 &fence);
+
+   if (!transfer_queue) {
+      vkQueueSubmit(vc->queue, 1,
+         &(VkSubmitInfo) {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &cmd_buffers[0],
+         }, fence);
+
+      vkWaitForFences(vc->device, 1, &fence, VK_TRUE, UINT64_MAX);
+      vkFreeCommandBuffers(vc->device, vc->cmd_pool, 1, &cmd_buffers[0]);
+   } else {
+      vkAllocateCommandBuffers(vc->device,
+                               &(VkCommandBufferAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                                  .commandPool = vc->cmd_pool,
+                                  .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                  .commandBufferCount = 1,
+                               },
+                               &cmd_buffers[1]);
+
+      vkBeginCommandBuffer(cmd_buffers[1],
+                           &(VkCommandBufferBeginInfo) {
+                              .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                              .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+                           });
+
+      /* Acquire: the source access was done by the release. */
+      VkBufferMemoryBarrier acquire = ownership;
+      acquire.srcAccessMask = 0;
+      vkCmdPipelineBarrier(cmd_buffers[1],
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           0, 0, NULL, 1, &acquire, 0, NULL);
+
+      vkEndCommandBuffer(cmd_buffers[1]);
+
+      VkSemaphore copied;
+      vkCreateSemaphore(vc->device,
+                        &(VkSemaphoreCreateInfo) {
+                           .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                        },
+                        NULL,
+                        &copied);
+
+      vkQueueSubmit(vc->transfer_queue, 1,
+         &(VkSubmitInfo) {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &cmd_buffers[0],
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &copied,
+         }, VK_NULL_HANDLE);
+
+      vkQueueSubmit(vc->queue, 1,
+         &(VkSubmitInfo) {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &copied,
+            .pWaitDstStageMask = (VkPipelineStageFlags []) {
+               VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            },
+            .commandBufferCount = 1,
+            .pCommandBuffers = &cmd_buffers[1],
+         }, fence);
+
+      /* The graphics submission waited for the copy, so the fence covers
+       * both.
+       */
+      vkWaitForFences(vc->device, 1, &fence, VK_TRUE, UINT64_MAX);
+      vkDestroySemaphore(vc->device, copied, NULL);
+      vkFreeCommandBuffers(vc->device, vc->transfer_cmd_pool, 1, &cmd_buffers[0]);
+      vkFreeCommandBuffers(vc->device, vc->cmd_pool, 1, &cmd_buffers[1]);
+   }
+
+   vkDestroyFence(vc->device, fence, NULL);
+   vkDestroyBuffer(vc->device, staging, NULL);
+   alloc_free(&vc->allocator, &staging_alloc);
+}
+
+/* Path of the pipeline cache file, creating its directory. Returns false if
+ * neither $XDG_CACHE_HOME nor $HOME is set.
+ */
+static bool
+get_pipeline_cache_path(char *path, size_t size)
+{
+   const char *cache_home = getenv("XDG_CACHE_HOME");
+   const char *home = getenv("HOME");
+   char dir[4096];
+
+   if (cache_home && cache_home[0] == '/') {
+      mkdir(cache_home, 0755);
+      snprintf(dir, sizeof(dir), "%s/vkcube", cache_home);
+   } else if (home) {
+      snprintf(dir, sizeof(dir), "%s/.cache", home);
+      mkdir(dir, 0755);
+      snprintf(dir, sizeof(dir), "%s/.cache/vkcube", home);
+   } else {
+      return false;
+   }
+
+   mkdir(dir, 0755);
+   snprintf(path, size, "%s/pipeline_cache.bin", dir);
+   return true;
+}
+
+/* Check the VkPipelineCacheHeaderVersionOne header against the device, a
+ * driver would silently ignore a foreign cache anyway.
+ */
+static bool
+pipeline_cache_valid(struct vkcube *vc, const uint8_t *data, size_t size)
+{
+   uint32_t header_size, header_version, vendor_id, device_id;
+
+   if (size < 16 + VK_UUID_SIZE)
+      return false;
+
+   memcpy(&header_size, data + 0, 4);
+   memcpy(&header_version, data + 4, 4);
+   memcpy(&vendor_id, data + 8, 4);
+   memcpy(&device_id, data + 12, 4);
+
+   return header_size >= 16 + VK_UUID_SIZE &&
+          header_size <= size &&
+          header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+          vendor_id == vc->properties.vendorID &&
+          device_id == vc->properties.deviceID &&
+          memcmp(data + 16, vc->properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+static void
+load_pipeline_cache(struct vkcube *vc)
+{
+   char path[4096];
+   void *data = NULL;
+   size_t size = 0;
+
+   if (vc->use_pipeline_cache && get_pipeline_cache_path(path, sizeof(path))) {
+      FILE *f = fopen(path, "rb");
+      if (f) {
+         struct stat st;
+         if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+            data = malloc(st.st_size);
+            if (data && fread(data, 1, st.st_size, f) == (size_t) st.st_size)
+               size = st.st_size;
+         }
+         fclose(f);
+      }
+
+      if (size > 0 && !pipeline_cache_valid(vc, data, size)) {
+         printf("ignoring pipeline cache %s created by another device or driver\n", path);
+         size = 0;
+      }
+   }
+
+   vc->pipeline_cache_warm = size > 0;
+
+   vkCreatePipelineCache(vc->device,
+                         &(VkPipelineCacheCreateInfo) {
+                            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+                            .initialDataSize = size,
+                            .pInitialData = size > 0 ? data : NULL,
+                         },
+                         NULL,
+                         &vc->pipeline_cache);
+
+   free(data);
+}
+
+/* Write the cache to a temporary file and rename it over the old one so a
+ * concurrent run never reads a partial cache.
+ */
+static void
+save_pipeline_cache(struct vkcube *vc)
+{
+   char path[4096], tmp_path[4096 + 16];
+   size_t size = 0;
+
+   if (!vc->use_pipeline_cache || !get_pipeline_cache_path(path, sizeof(path)))
+      return;
+
+   if (vkGetPipelineCacheData(vc->device, vc->pipeline_cache, &size, NULL) != VK_SUCCESS ||
+       size == 0)
+      return;
+
+   void *data = malloc(size);
+   if (!data)
+      return;
+
+   if (vkGetPipelineCacheData(vc->device, vc->pipeline_cache, &size, data) == VK_SUCCESS) {
+      snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+
+      FILE *f = fopen(tmp_path, "wb");
+      if (f) {
+         bool ok = fwrite(data, 1, size, f) == size;
+         ok = fclose(f) == 0 && ok;
+         if (!ok || rename(tmp_path, path) != 0) {
+            printf("failed to write pipeline cache %s\n", path);
+            unlink(tmp_path);
+         }
+      }
+   }
+
+   free(data);
+}
+
+#define GRID_SPACING 3.0f
+
+/* Lay out the --grid cubes. Each spins around its own axis with its own
+ * phase; the inputs stay in SoA arrays for transform_update().
+ */
+static void
+init_instances(struct vkcube *vc)
+{
+   struct transform_batch *batch = &vc->instances;
+   uint32_t n = vc->grid;
+   float half = GRID_SPACING * (n - 1) / 2.0f;
+   float **arrays[] = {
+      &batch->x, &batch->y, &batch->z,
+      &batch->axis_x, &batch->axis_y, &batch->axis_z,
+      &batch->angle, &vc->instance_phase
+   };
+
+   batch->count = vc->instance_count;
+   for (unsigned a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++) {
+      *arrays[a] = aligned_alloc(64, (batch->count * sizeof(float) + 63) & ~63);
+      if (!*arrays[a]) {
+         fprintf(stderr, "out of memory\n");
+         abort();
+      }
+   }
+
+   uint32_t i = 0;
+   for (uint32_t z = 0; z < n; z++) {
+      for (uint32_t y = 0; y < n; y++) {
+         for (uint32_t x = 0; x < n; x++, i++) {
+            float ax = sinf(i * 1.7f), ay = cosf(i * 2.3f), az = 0.5f;
+            float mag = sqrtf(ax * ax + ay * ay + az * az);
+
+            batch->x[i] = x * GRID_SPACING - half;
+            batch->y[i] = y * GRID_SPACING - half;
+            batch->z[i] = z * GRID_SPACING - half;
+            batch->axis_x[i] = ax / mag;
+            batch->axis_y[i] = ay / mag;
+            batch->axis_z[i] = az / mag;
+            /* kept below 360 so angles stay precise as floats */
+            vc->instance_phase[i] = (37u * i) % 360;
+         }
+      }
+   }
+
+   worker_pool_init(&vc->update_pool, vc->update_threads);
+}
+
+/* Write the matrices of the --grid cubes at time t. The grid turns slowly as
+ * a whole while every cube spins. The view keeps the single cube's field of
+ * view, backed off so the grid fits.
+ */
+static void
+update_instances(struct vkcube *vc, uint64_t t, struct ubo *instances)
+{
+   struct transform_batch *batch = &vc->instances;
+   float half = GRID_SPACING * (vc->grid - 1) / 2.0f;
+   float radius = (half + 1.0f) * sqrtf(3.0f);
+   float distance = 2.5f * radius;
+   float near = distance - radius, far = distance + radius;
+   float extent = 2.8f / 6.0f * near;
+   float aspect = (float) vc->height / (float) vc->width;
+
+   ESMatrix projection;
+   esMatrixLoadIdentity(&projection);
+   esFrustum(&projection, -extent, +extent, -extent * aspect, +extent * aspect, near, far);
+
+   ESMatrix view;
+   esMatrixLoadIdentity(&view);
+   esTranslate(&view, 0.0f, 0.0f, -distance);
+   esRotate(&view, 20.0f + (0.05f * t), 1.0f, 0.0f, 0.0f);
+   esRotate(&view, 0.1f * t, 0.0f, 1.0f, 0.0f);
+
+   for (uint32_t i = 0; i < batch->count; i++)
+      batch->angle[i] = vc->instance_phase[i] + 0.25f * t;
+
+   transform_update(&vc->update_pool, batch, &view, &projection, instances);
+}
+
+/* Load path and reorder it for mode, reporting the time taken and the
+ * resulting ACMR, which is also returned in *acmr.
+ */
+static bool
+load_mesh(const char *path, enum mesh_optimize mode, struct mesh *mesh, float *acmr)
+{
+   uint64_t start_ns = get_time_ns();
+   float acmr_before;
+
+   if (!mesh_load(path, mesh))
+      return false;
+   printf("mesh %s: %u vertices, %u triangles, loaded in %.1f ms\n",
+          path, mesh->vertex_count, mesh->index_count / 3, (get_time_ns() - start_ns) / 1e6);
+
+   start_ns = get_time_ns();
+   mesh_optimize(mesh, mode, &acmr_before, acmr);
+   if (mode != MESH_OPTIMIZE_NONE) {
+      printf("mesh optimized for %s in %.1f ms: ACMR %.3f -> %.3f (%u entry FIFO), %u vertices\n",
+             mesh_optimize_names[mode], (get_time_ns() - start_ns) / 1e6,
+             acmr_before, *acmr, MESH_CACHE_SIZE, mesh->vertex_count);
+   } else {
+      printf("mesh ACMR %.3f (%u entry FIFO)\n", *acmr, MESH_CACHE_SIZE);
+   }
+
+   return true;
+}
+
+/* Upload mesh into vc->vertex_buffer in vc->vertex_layout and its indices
+ * into vc->index_buffer, 16 bit wide when the vertex count allows it.
+ */
+static void
+upload_mesh(struct vkcube *vc, const struct mesh *mesh)
+{
+   uint32_t vertex_count = mesh->vertex_count;
+   size_t vertex_size;
+   uint8_t *vertex_data;
+
+   vc->vertex_count = vertex_count;
+
+   switch (vc->vertex_layout) {
+   case VERTEX_LAYOUT_SEPARATE:
+      vc->vertex_offset = 0;
+      vc->colors_offset = vc->vertex_offset + vertex_count * 3 * sizeof(float);
+      vc->normals_offset = vc->colors_offset + vertex_count * 3 * sizeof(float);
+
+      vertex_size = vertex_count * 9 * sizeof(float);
+
+      /* A mapped .vkmesh already has this layout, stage straight from it. */
+      if (mesh->colors == mesh->positions + vertex_count * 3 &&
+          mesh->normals == mesh->colors + vertex_count * 3) {
+         vertex_data = NULL;
+         break;
+      }
+
+      vertex_data = mesh_realloc(NULL, vertex_size);
+      memcpy(vertex_data + vc->vertex_offset, mesh->positions, vertex_count * 3 * sizeof(float));
+      memcpy(vertex_data + vc->colors_offset, mesh->colors, vertex_count * 3 * sizeof(float));
+      memcpy(vertex_data + vc->normals_offset, mesh->normals, vertex_count * 3 * sizeof(float));
+      break;
+
+   case VERTEX_LAYOUT_INTERLEAVED: {
+      struct vertex_interleaved *v;
+
+      vertex_size = vertex_count * sizeof(*v);
+      vertex_data = mesh_realloc(NULL, vertex_size);
+      v = (struct vertex_interleaved *) vertex_data;
+      for (uint32_t i = 0; i < vertex_count; i++) {
+         memcpy(v[i].position, &mesh->positions[i * 3], sizeof(v[i].position));
+         memcpy(v[i].color, &mesh->colors[i * 3], sizeof(v[i].color));
+         memcpy(v[i].normal, &mesh->normals[i * 3], sizeof(v[i].normal));
+      }
+      break;
+   }
+
+   case VERTEX_LAYOUT_PACKED: {
+      struct vertex_packed *v;
+
+      vertex_size = vertex_count * sizeof(*v);
+      vertex_data = mesh_realloc(NULL, vertex_size);
+      v = (struct vertex_packed *) vertex_data;
+      for (uint32_t i = 0; i < vertex_count; i++) {
+         memcpy(v[i].position, &mesh->positions[i * 3], sizeof(v[i].position));
+         for (int c = 0; c < 3; c++) {
+            v[i].color[c] = lroundf(mesh->colors[i * 3 + c] * 255.0f);
+            v[i].normal[c] = lroundf(mesh->normals[i * 3 + c] * 127.0f);
+         }
+         v[i].color[3] = 255;
+         v[i].normal[3] = 0;
+      }
+      break;
+   }
+   }
+
+   create_static_buffer(vc, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                        vertex_data ? vertex_data : (const uint8_t *) mesh->positions, vertex_size,
+                        &vc->vertex_buffer, &vc->vertex_alloc);
+   free(vertex_data);
+
+   vc->index_count = mesh->index_count;
+   if (vertex_count <= UINT16_MAX + 1) {
+      uint16_t *indices = mesh_realloc(NULL, mesh->index_count * sizeof(uint16_t));
+
+      for (uint32_t i = 0; i < mesh->index_count; i++)
+         indices[i] = mesh->indices[i];
+
+      vc->index_type = VK_INDEX_TYPE_UINT16;
+      create_static_buffer(vc, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                           indices, mesh->index_count * sizeof(uint16_t),
+                           &vc->index_buffer, &vc->index_alloc);
+      free(indices);
+   } else {
+      vc->index_type = VK_INDEX_TYPE_UINT32;
+      create_static_buffer(vc, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                           mesh->indices, mesh->index_count * sizeof(uint32_t),
+                           &vc->index_buffer, &vc->index_alloc);
+   }
+}
+
+/* Allocate from the frame's arena, which is sized for everything a frame
+ * writes.
+ */
+static void *
+frame_alloc(struct vkcube *vc, struct vkcube_frame *frame, VkDeviceSize size,
+            VkDeviceSize alignment, VkDeviceSize *offset)
+{
+   void *map = arena_alloc(&frame->arena, size, alignment, offset);
+
+   if (!map) {
+      fprintf(stderr, "frame arena of %lu bytes exhausted\n",
+              (unsigned long) vc->frame_arena_size);
+      exit(1);
+   }
+
+   return map;
+}
+
+/* Lay out the frame's arena: its UBO, then its instances. The layout is the
+ * same every frame, so commands recorded for the slot stay valid.
+ */
+static void
+frame_layout(struct vkcube *vc, struct vkcube_frame *frame,
+             void **ubo_map, void **instance_map)
+{
+   arena_reset(&frame->arena);
+   *ubo_map = frame_alloc(vc, frame, sizeof(struct ubo),
+                          vc->properties.limits.minUniformBufferOffsetAlignment,
+                          &frame->ubo_offset);
+
+   *instance_map = NULL;
+   frame->instance_offset = 0;
+   if (vc->instance_count > 0)
+      *instance_map = frame_alloc(vc, frame, vc->instance_count * sizeof(struct ubo),
+                                  _Alignof(struct ubo), &frame->instance_offset);
 }
 
 static void
 init_cube(struct vkcube *vc)
 {
-   VkResult r;
 
-   VkDescriptorSetLayout set_layout;
    vkCreateDescriptorSetLayout(vc->device,
                                &(VkDescriptorSetLayoutCreateInfo) {
                                   .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
                                   .bindingCount = 1,
                                   .pBindings = (VkDescriptorSetLayoutBinding[]) {
                                      {
-                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                         .descriptorCount = 1,
                                         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
                                         .pImmutableSamplers = NULL
@@ -347,66 +1272,106 @@ init_cube(struct vkcube *vc)
                                   }
                                },
                                NULL,
-                               &set_layout);
+                               &vc->set_layout);
 
    vkCreatePipelineLayout(vc->device,
                           &(VkPipelineLayoutCreateInfo) {
                              .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
                              .setLayoutCount = 1,
-                             .pSetLayouts = &set_layout,
+                             .pSetLayouts = &vc->set_layout,
                           },
                           NULL,
                           &vc->pipeline_layout);
 
-   VkPipelineVertexInputStateCreateInfo vi_create_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-      .vertexBindingDescriptionCount = 3,
-      .pVertexBindingDescriptions = (VkVertexInputBindingDescription[]) {
-         {
-            .binding = 0,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 1,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 2,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         }
+   bool interleaved = vc->vertex_layout != VERTEX_LAYOUT_SEPARATE;
+   bool packed = vc->vertex_layout == VERTEX_LAYOUT_PACKED;
+
+   /* The shader reads vec4/vec3 inputs either way, missing components are
+    * filled in and the SNORM normal's w is ignored.
+    */
+   VkVertexInputBindingDescription bindings[4] = {
+      {
+         .binding = 0,
+         .stride = packed ? sizeof(struct vertex_packed) :
+                   interleaved ? sizeof(struct vertex_interleaved) :
+                   3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
       },
-      .vertexAttributeDescriptionCount = 3,
-      .pVertexAttributeDescriptions = (VkVertexInputAttributeDescription[]) {
-         {
-            .location = 0,
-            .binding = 0,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         },
-         {
-            .location = 1,
-            .binding = 1,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         },
-         {
-            .location = 2,
-            .binding = 2,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         }
+      {
+         .binding = 1,
+         .stride = 3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+      },
+      {
+         .binding = 2,
+         .stride = 3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
       }
    };
+   uint32_t binding_count = interleaved ? 1 : 3;
+
+   VkVertexInputAttributeDescription attributes[3 + 11] = {
+      {
+         .location = 0,
+         .binding = 0,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = 0
+      },
+      {
+         .location = 1,
+         .binding = interleaved ? 0 : 1,
+         .format = packed ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = packed ? offsetof(struct vertex_packed, color) :
+                   interleaved ? offsetof(struct vertex_interleaved, color) : 0
+      },
+      {
+         .location = 2,
+         .binding = interleaved ? 0 : 2,
+         .format = packed ? VK_FORMAT_R8G8B8A8_SNORM : VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = packed ? offsetof(struct vertex_packed, normal) :
+                   interleaved ? offsetof(struct vertex_interleaved, normal) : 0
+      }
+   };
+   uint32_t attribute_count = 3;
+
+   /* Instances read a struct ubo each through binding 3, one attribute per
+    * matrix column.
+    */
+   if (vc->instance_count > 0) {
+      bindings[binding_count++] = (VkVertexInputBindingDescription) {
+         .binding = 3,
+         .stride = sizeof(struct ubo),
+         .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE
+      };
+
+      for (uint32_t i = 0; i < 11; i++) {
+         attributes[attribute_count++] = (VkVertexInputAttributeDescription) {
+            .location = 3 + i,
+            .binding = 3,
+            .format = i < 8 ? VK_FORMAT_R32G32B32A32_SFLOAT : VK_FORMAT_R32G32B32_SFLOAT,
+            .offset = i * 4 * sizeof(float)
+         };
+      }
+   }
+
+   VkPipelineVertexInputStateCreateInfo vi_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .vertexBindingDescriptionCount = binding_count,
+      .pVertexBindingDescriptions = bindings,
+      .vertexAttributeDescriptionCount = attribute_count,
+      .pVertexAttributeDescriptions = attributes
+   };
 
    VkShaderModule vs_module;
    vkCreateShaderModule(vc->device,
                         &(VkShaderModuleCreateInfo) {
                            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-                           .codeSize = sizeof(vs_spirv_source),
-                           .pCode = (uint32_t *)vs_spirv_source,
+                           .codeSize = vc->instance_count > 0 ?
+                                       sizeof(vs_instanced_spirv_source) :
+                                       sizeof(vs_spirv_source),
+                           .pCode = vc->instance_count > 0 ?
+                                       vs_instanced_spirv_source :
+                                       vs_spirv_source,
                         },
                         NULL,
                         &vs_module);
@@ -421,8 +1386,12 @@ init_cube(struct vkcube *vc)
                         NULL,
                         &fs_module);
 
+   load_pipeline_cache(vc);
+
+   uint64_t pipeline_start_ns = get_time_ns();
+
    vkCreateGraphicsPipelines(vc->device,
-      (VkPipelineCache) { VK_NULL_HANDLE },
+      vc->pipeline_cache,
       1,
       &(VkGraphicsPipelineCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
@@ -444,7 +1413,7 @@ init_cube(struct vkcube *vc)
          .pVertexInputState = &vi_create_info,
          .pInputAssemblyState = &(VkPipelineInputAssemblyStateCreateInfo) {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
             .primitiveRestartEnable = false,
          },
 
@@ -468,7 +1437,10 @@ init_cube(struct vkcube *vc)
             .rasterizationSamples = 1,
          },
          .pDepthStencilState = &(VkPipelineDepthStencilStateCreateInfo) {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+            .depthTestEnable = vc->depth_format != VK_FORMAT_UNDEFINED,
+            .depthWriteEnable = vc->depth_format != VK_FORMAT_UNDEFINED,
+            .depthCompareOp = VK_COMPARE_OP_LESS,
          },
 
          .pColorBlendState = &(VkPipelineColorBlendStateCreateInfo) {
@@ -501,6 +1473,16 @@ init_cube(struct vkcube *vc)
       NULL,
       &vc->pipeline);
 
+   vc->pipeline_ns = get_time_ns() - pipeline_start_ns;
+   printf("pipeline created in %.3f ms (%s pipeline cache)\n",
+          vc->pipeline_ns / 1e6,
+          !vc->use_pipeline_cache ? "no" : vc->pipeline_cache_warm ? "warm" : "cold");
+
+   save_pipeline_cache(vc);
+
+   vkDestroyShaderModule(vc->device, vs_module, NULL);
+   vkDestroyShaderModule(vc->device, fs_module, NULL);
+
    static const float vVertices[] = {
       // front
       -1.0f, -1.0f, +1.0f, // point blue
@@ -600,51 +1582,61 @@ init_cube(struct vkcube *vc)
       +0.0f, -1.0f, +0.0f  // down
    };
 
-   vc->vertex_offset = sizeof(struct ubo);
-   vc->colors_offset = vc->vertex_offset + sizeof(vVertices);
-   vc->normals_offset = vc->colors_offset + sizeof(vColors);
-   uint32_t mem_size = vc->normals_offset + sizeof(vNormals);
-
-   vkCreateBuffer(vc->device,
-                  &(VkBufferCreateInfo) {
-                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                     .size = mem_size,
-                     .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                     .flags = 0
-                  },
-                  NULL,
-                  &vc->buffer);
+   /* Each face was drawn as a 4 vertex strip, split into two triangles
+    * with the strip's winding.
+    */
+   uint32_t indices[6 * 6];
+   for (uint32_t face = 0; face < 6; face++) {
+      uint32_t base = face * 4;
+      memcpy(&indices[face * 6],
+             (uint32_t[]) { base, base + 1, base + 2, base + 2, base + 1, base + 3 },
+             6 * sizeof(uint32_t));
+   }
 
-   VkMemoryRequirements reqs;
-   vkGetBufferMemoryRequirements(vc->device, vc->buffer, &reqs);
+   if (vc->mesh_path) {
+      struct mesh mesh;
+
+      if (!load_mesh(vc->mesh_path, vc->mesh_optimize, &mesh, &vc->mesh_acmr))
+         exit(1);
+
+      upload_mesh(vc, &mesh);
+      mesh_free(&mesh);
+   } else {
+      vc->mesh_acmr = mesh_acmr(indices, ARRAY_SIZE(indices), ARRAY_SIZE(vVertices) / 3,
+                                MESH_CACHE_SIZE);
+      upload_mesh(vc, &(struct mesh) {
+                     .vertex_count = sizeof(vVertices) / (3 * sizeof(float)),
+                     .positions = vVertices,
+                     .colors = vColors,
+                     .normals = vNormals,
+                     .index_count = sizeof(indices) / sizeof(indices[0]),
+                     .indices = indices,
+                  });
+   }
 
-   int memory_type = find_host_coherent_memory(vc, reqs.memoryTypeBits);
-   if (memory_type < 0)
-   {
-		exit("find_host_coherent_memory failed");
+   if (vc->instance_count > 0)
+      init_instances(vc);
+
+   /* Only the frame arenas stay in host-visible memory. Each fits one UBO
+    * and the instances at their worst-case alignment, plus headroom.
+    */
+   VkDeviceSize ubo_align = vc->properties.limits.minUniformBufferOffsetAlignment;
+   VkDeviceSize arena_size = sizeof(struct ubo) + ubo_align +
+                             (VkDeviceSize) vc->instance_count * sizeof(struct ubo) + ubo_align +
+                             FRAME_ARENA_HEADROOM;
+   vc->frame_arena_size = (arena_size + ubo_align - 1) & ~(ubo_align - 1);
+   create_buffer(vc, vc->frame_arena_size * vc->frames_in_flight,
+                 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                 true, &vc->frame_buffer, &vc->frame_alloc);
+   for (uint32_t i = 0; i < vc->frames_in_flight; i++) {
+      void *ubo_map, *instance_map;
+
+      arena_init(&vc->frames[i].arena, vc->frame_buffer, &vc->frame_alloc,
+                 i * vc->frame_arena_size, vc->frame_arena_size);
+      /* known up front so --prerecord can record each slot's commands */
+      frame_layout(vc, &vc->frames[i], &ubo_map, &instance_map);
    }
-    //   fail("find_host_coherent_memory failed");
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = mem_size,
-                       .memoryTypeIndex = memory_type,
-                    },
-                    NULL,
-                    &vc->mem);
-
-   r = vkMapMemory(vc->device, vc->mem, 0, mem_size, 0, &vc->map);
-   if (r != VK_SUCCESS)
-      fail("vkMapMemory failed");
-   memcpy(vc->map + vc->vertex_offset, vVertices, sizeof(vVertices));
-   memcpy(vc->map + vc->colors_offset, vColors, sizeof(vColors));
-   memcpy(vc->map + vc->normals_offset, vNormals, sizeof(vNormals));
-
-   vkBindBufferMemory(vc->device, vc->buffer, vc->mem, 0);
-
-   VkDescriptorPool desc_pool;
+
    const VkDescriptorPoolCreateInfo create_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
       .pNext = NULL,
@@ -653,20 +1645,20 @@ init_cube(struct vkcube *vc)
       .poolSizeCount = 1,
       .pPoolSizes = (VkDescriptorPoolSize[]) {
          {
-            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             .descriptorCount = 1
          },
       }
    };
 
-   vkCreateDescriptorPool(vc->device, &create_info, NULL, &desc_pool);
+   vkCreateDescriptorPool(vc->device, &create_info, NULL, &vc->descriptor_pool);
 
    vkAllocateDescriptorSets(vc->device,
       &(VkDescriptorSetAllocateInfo) {
          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-         .descriptorPool = desc_pool,
+         .descriptorPool = vc->descriptor_pool,
          .descriptorSetCount = 1,
-         .pSetLayouts = &set_layout,
+         .pSetLayouts = &vc->set_layout,
       }, &vc->descriptor_set);
 
    vkUpdateDescriptorSets(vc->device, 1,
@@ -677,9 +1669,9 @@ init_cube(struct vkcube *vc)
                                 .dstBinding = 0,
                                 .dstArrayElement = 0,
                                 .descriptorCount = 1,
-                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                 .pBufferInfo = &(VkDescriptorBufferInfo) {
-                                   .buffer = vc->buffer,
+                                   .buffer = vc->frame_buffer,
                                    .offset = 0,
                                    .range = sizeof(struct ubo),
                                 }
@@ -688,105 +1680,265 @@ init_cube(struct vkcube *vc)
                           0, NULL);
 }
 
+static uint32_t
+object_count(struct vkcube *vc)
+{
+   return vc->instance_count > 0 ? vc->instance_count : 1;
+}
+
+/* Record the draws of objects [begin, end) into cmd, inside the render
+ * pass. Secondary command buffers inherit no state, so everything is bound
+ * again.
+ */
 static void
-render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
+record_draws(struct vkcube *vc, const struct vkcube_frame *frame, VkCommandBuffer cmd,
+             uint32_t begin, uint32_t end)
 {
-   struct ubo ubo;
-   struct timeval tv;
-   uint64_t t;
+   uint32_t ubo_offset = frame->ubo_offset;
+
+   if (vc->vertex_layout == VERTEX_LAYOUT_SEPARATE) {
+      vkCmdBindVertexBuffers(cmd, 0, 3,
+                             (VkBuffer[]) {
+                                vc->vertex_buffer,
+                                vc->vertex_buffer,
+                                vc->vertex_buffer
+                             },
+                             (VkDeviceSize[]) {
+                                vc->vertex_offset,
+                                vc->colors_offset,
+                                vc->normals_offset
+                             });
+   } else {
+      vkCmdBindVertexBuffers(cmd, 0, 1,
+                             &vc->vertex_buffer,
+                             (VkDeviceSize[]) { 0 });
+   }
+   if (vc->instance_count > 0) {
+      vkCmdBindVertexBuffers(cmd, 3, 1,
+                             &vc->frame_buffer,
+                             &frame->instance_offset);
+   }
+   vkCmdBindIndexBuffer(cmd, vc->index_buffer, 0, vc->index_type);
 
-   gettimeofday(&tv, NULL);
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vc->pipeline);
 
-   t = ((tv.tv_sec * 1000 + tv.tv_usec / 1000) -
-        (vc->start_tv.tv_sec * 1000 + vc->start_tv.tv_usec / 1000)) / 5;
+   vkCmdBindDescriptorSets(cmd,
+                           VK_PIPELINE_BIND_POINT_GRAPHICS,
+                           vc->pipeline_layout,
+                           0, 1,
+                           &vc->descriptor_set, 1, &ubo_offset);
 
-   esMatrixLoadIdentity(&ubo.modelview);
-   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
-   esRotate(&ubo.modelview, 45.0f + (0.25f * t), 1.0f, 0.0f, 0.0f);
-   esRotate(&ubo.modelview, 45.0f - (0.5f * t), 0.0f, 1.0f, 0.0f);
-   esRotate(&ubo.modelview, 10.0f + (0.15f * t), 0.0f, 0.0f, 1.0f);
+   const VkViewport viewport = {
+      .x = 0,
+      .y = 0,
+      .width = vc->width,
+      .height = vc->height,
+      .minDepth = 0,
+      .maxDepth = 1,
+   };
+   vkCmdSetViewport(cmd, 0, 1, &viewport);
 
-   float aspect = (float) vc->height / (float) vc->width;
-   ESMatrix projection;
-   esMatrixLoadIdentity(&projection);
-   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+   const VkRect2D scissor = {
+      .offset = { 0, 0 },
+      .extent = { vc->width, vc->height },
+   };
+   vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+   /* Objects are instances, firstInstance selects their transforms. */
+   if (vc->separate_draws) {
+      for (uint32_t i = begin; i < end; i++)
+         vkCmdDrawIndexed(cmd, vc->index_count, 1, 0, 0, i);
+   } else if (end > begin) {
+      vkCmdDrawIndexed(cmd, vc->index_count, end - begin, 0, 0, begin);
+   }
+}
 
-   esMatrixLoadIdentity(&ubo.modelviewprojection);
-   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+struct record_job {
+   struct vkcube *vc;
+   struct vkcube_buffer *b;
+   uint32_t slot;
+};
 
-   /* The mat3 normalMatrix is laid out as 3 vec4s. */
-   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+/* Record one thread's slice of the objects into its secondary command
+ * buffer, allocated from that thread's own command pool.
+ */
+static void
+record_worker(void *data, uint32_t index, uint32_t count)
+{
+   struct record_job *job = data;
+   struct vkcube *vc = job->vc;
+   struct vkcube_buffer *b = job->b;
+   VkCommandBuffer cmd = b->secondary[job->slot][index];
+   uint32_t begin, end;
+
+   worker_range(object_count(vc), index, count, 1, &begin, &end);
 
-   memcpy(vc->map, &ubo, sizeof(ubo));
+   vkBeginCommandBuffer(cmd,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+                           .pInheritanceInfo = &(VkCommandBufferInheritanceInfo) {
+                              .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+                              .renderPass = vc->render_pass,
+                              .subpass = 0,
+                              .framebuffer = b->framebuffer,
+                           },
+                        });
+
+   record_draws(vc, &vc->frames[job->slot], cmd, begin, end);
+
+   vkEndCommandBuffer(cmd);
+}
 
-   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
-   vkResetFences(vc->device, 1, &b->fence);
+/* Record the commands drawing the cube into b for frame slot slot. They bake
+ * in the slot's arena offsets of the UBO and instances, so the slot's buffer
+ * must be re-recorded when those offsets change.
+ */
+static void
+record_cube(struct vkcube *vc, struct vkcube_buffer *b, uint32_t slot)
+{
+   VkCommandBuffer cmd = b->cmd_buffers[slot];
+   uint32_t query = (b - vc->buffers) * 2;
 
-   vkBeginCommandBuffer(b->cmd_buffer,
+   vkBeginCommandBuffer(cmd,
                         &(VkCommandBufferBeginInfo) {
                            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
                            .flags = 0
                         });
 
-   vkCmdBeginRenderPass(b->cmd_buffer,
+   if (vc->query_pool != VK_NULL_HANDLE) {
+      vkCmdResetQueryPool(cmd, vc->query_pool, query, 2);
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                          vc->query_pool, query);
+   }
+
+   vkCmdBeginRenderPass(cmd,
                         &(VkRenderPassBeginInfo) {
                            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
                            .renderPass = vc->render_pass,
                            .framebuffer = b->framebuffer,
                            .renderArea = { { 0, 0 }, { vc->width, vc->height } },
-                           .clearValueCount = 1,
+                           .clearValueCount = vc->depth_format != VK_FORMAT_UNDEFINED ? 2 : 1,
                            .pClearValues = (VkClearValue []) {
-                              { .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } } }
+                              { .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } } },
+                              { .depthStencil = { .depth = 1.0f } }
                            }
                         },
-                        VK_SUBPASS_CONTENTS_INLINE);
+                        vc->record_pool.count > 0 ?
+                           VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+                           VK_SUBPASS_CONTENTS_INLINE);
 
-   vkCmdBindVertexBuffers(b->cmd_buffer, 0, 3,
-                          (VkBuffer[]) {
-                             vc->buffer,
-                             vc->buffer,
-                             vc->buffer
-                          },
-                          (VkDeviceSize[]) {
-                             vc->vertex_offset,
-                             vc->colors_offset,
-                             vc->normals_offset
-                           });
+   if (vc->record_pool.count > 0) {
+      struct record_job job = { .vc = vc, .b = b, .slot = slot };
 
-   vkCmdBindPipeline(b->cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vc->pipeline);
+      worker_pool_run(&vc->record_pool, record_worker, &job);
+      vkCmdExecuteCommands(cmd, vc->record_pool.count, b->secondary[slot]);
+   } else {
+      record_draws(vc, &vc->frames[slot], cmd, 0, object_count(vc));
+   }
 
-   vkCmdBindDescriptorSets(b->cmd_buffer,
-                           VK_PIPELINE_BIND_POINT_GRAPHICS,
-                           vc->pipeline_layout,
-                           0, 1,
-                           &vc->descriptor_set, 0, NULL);
+   vkCmdEndRenderPass(cmd);
+
+   if (vc->query_pool != VK_NULL_HANDLE)
+      vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                          vc->query_pool, query + 1);
+
+   /* The render pass leaves headless images in TRANSFER_SRC_OPTIMAL and its
+    * external dependency orders the copy after the color writes.
+    */
+   if (b->readback != VK_NULL_HANDLE) {
+      vkCmdCopyImageToBuffer(cmd,
+                             b->image,
+                             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                             b->readback,
+                             1,
+                             &(VkBufferImageCopy) {
+                                .bufferOffset = 0,
+                                .bufferRowLength = 0,
+                                .bufferImageHeight = 0,
+                                .imageSubresource = {
+                                   .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                   .mipLevel = 0,
+                                   .baseArrayLayer = 0,
+                                   .layerCount = 1,
+                                },
+                                .imageOffset = { 0, 0, 0 },
+                                .imageExtent = { vc->width, vc->height, 1 },
+                             });
+
+      vkCmdPipelineBarrier(cmd,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_HOST_BIT,
+                           0,
+                           1, &(VkMemoryBarrier) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                              .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                              .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+                           },
+                           0, NULL,
+                           0, NULL);
+   }
 
-   const VkViewport viewport = {
-      .x = 0,
-      .y = 0,
-      .width = vc->width,
-      .height = vc->height,
-      .minDepth = 0,
-      .maxDepth = 1,
-   };
-   vkCmdSetViewport(b->cmd_buffer, 0, 1, &viewport);
+   vkEndCommandBuffer(cmd);
+}
 
-   const VkRect2D scissor = {
-      .offset = { 0, 0 },
-      .extent = { vc->width, vc->height },
-   };
-   vkCmdSetScissor(b->cmd_buffer, 0, 1, &scissor);
+static void
+render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
+{
+   struct ubo ubo;
+   struct timeval tv;
+   uint64_t t;
+   uint64_t start_ns = get_time_ns();
 
-   vkCmdDraw(b->cmd_buffer, 4, 1, 0, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 4, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 8, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 12, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 16, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 20, 0);
+   gettimeofday(&tv, NULL);
+
+   t = ((tv.tv_sec * 1000 + tv.tv_usec / 1000) -
+        (vc->start_tv.tv_sec * 1000 + vc->start_tv.tv_usec / 1000)) / 5;
+
+   esMatrixLoadIdentity(&ubo.modelview);
+   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
+   esRotate(&ubo.modelview, 45.0f + (0.25f * t), 1.0f, 0.0f, 0.0f);
+   esRotate(&ubo.modelview, 45.0f - (0.5f * t), 0.0f, 1.0f, 0.0f);
+   esRotate(&ubo.modelview, 10.0f + (0.15f * t), 0.0f, 0.0f, 1.0f);
+
+   float aspect = (float) vc->height / (float) vc->width;
+   ESMatrix projection;
+   esMatrixLoadIdentity(&projection);
+   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+
+   esMatrixLoadIdentity(&ubo.modelviewprojection);
+   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
 
-   vkCmdEndRenderPass(b->cmd_buffer);
+   /* The mat3 normalMatrix is laid out as 3 vec4s. */
+   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+
+   /* The caller has already waited for this frame slot, so its arena and
+    * its command buffers are free again. The buffer's image may still be in
+    * use by an older frame when images are acquired out of order.
+    */
+   struct vkcube_frame *frame = &vc->frames[vc->frame_index];
+   if (b->fence != VK_NULL_HANDLE && b->fence != frame->fence) {
+      uint64_t wait_ns = get_time_ns();
+      vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+      start_ns += get_time_ns() - wait_ns;
+   }
+   b->fence = frame->fence;
+   frame->buffer = b;
+   vkResetFences(vc->device, 1, &frame->fence);
+
+   void *ubo_map, *instance_map;
+   frame_layout(vc, frame, &ubo_map, &instance_map);
+   memcpy(ubo_map, &ubo, sizeof(ubo));
+
+   if (vc->instance_count > 0) {
+      uint64_t update_start_ns = get_time_ns();
+      update_instances(vc, t, instance_map);
+      frame->update_ns = get_time_ns() - update_start_ns;
+   }
 
-   vkEndCommandBuffer(b->cmd_buffer);
+   /* pre-recorded commands were recorded for every frame slot */
+   if (!vc->prerecord)
+      record_cube(vc, b, vc->frame_index);
 
    VkProtectedSubmitInfo protected_info = {
       .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
@@ -797,15 +1949,20 @@ render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
       &(VkSubmitInfo) {
          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
          .pNext = &protected_info,
-         /* headless mode does not signal vc->semaphore */
+         /* headless mode neither acquires nor presents */
          .waitSemaphoreCount = wait_semaphore ? 1 : 0,
-         .pWaitSemaphores = &vc->semaphore,
+         .pWaitSemaphores = &frame->acquire_semaphore,
          .pWaitDstStageMask = (VkPipelineStageFlags []) {
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
          },
          .commandBufferCount = 1,
-         .pCommandBuffers = &b->cmd_buffer,
-      }, b->fence);
+         .pCommandBuffers = &b->cmd_buffers[vc->frame_index],
+         .signalSemaphoreCount = wait_semaphore ? 1 : 0,
+         .pSignalSemaphores = &b->render_semaphore,
+      }, frame->fence);
+
+   frame->submit_ns = get_time_ns();
+   frame->cpu_ns = frame->submit_ns - start_ns;
 }
 
 struct model cube_model = {
@@ -40,6 +40,7 @@
 
 
 #include "cube.h"
+#include "bench.h"
 
 enum display_mode {
    DISPLAY_MODE_AUTO = 0,
@@ -53,6 +54,94 @@ static enum display_mode display_mode = DISPLAY_MODE_XCB;
 static uint32_t width = 1024, height = 768;
 static const char *arg_out_file = "./cube.png";
 static bool protected_chain = false;
+static uint32_t frames_in_flight = 2;
+static bool prerecord = false;
+static uint32_t frame_count = 1;
+static bool use_pipeline_cache = true;
+static bool host_vertices = false;
+static enum vertex_layout vertex_layout = VERTEX_LAYOUT_SEPARATE;
+static uint32_t grid = 0;
+static bool bench_matrix = false;
+static bool bench_transforms = false;
+static uint32_t update_threads = 1;
+static bool separate_draws = false;
+static uint32_t record_threads = 0;
+static bool bench_record = false;
+static int present_mode = -1;
+static uint32_t swap_image_count = 0;
+static uint32_t fps_limit = 0;
+static const char *device_arg = NULL;
+static bool list_devices_only = false;
+static bool bench_alloc = false;
+static const char *mesh_path = NULL;
+static const char *convert_mesh_path = NULL;
+static bool bench_mesh_load = false;
+static enum mesh_optimize mesh_optimize_mode = MESH_OPTIMIZE_NONE;
+
+static const char *const present_mode_names[] = {
+	[VK_PRESENT_MODE_IMMEDIATE_KHR] = "immediate",
+	[VK_PRESENT_MODE_MAILBOX_KHR] = "mailbox",
+	[VK_PRESENT_MODE_FIFO_KHR] = "fifo",
+	[VK_PRESENT_MODE_FIFO_RELAXED_KHR] = "fifo-relaxed",
+};
+
+/* Raw RGBA output is a single stream of frames. */
+static FILE *raw_out_file;
+
+static struct bench bench;
+
+/* Throughput and latency of the frames retired since the last report. The
+ * latency of a frame is measured from the start of its CPU work until its
+ * fence is observed signaled when the frame slot is reused.
+ */
+#define STATS_INTERVAL_NS 2000000000ull
+
+static struct {
+	uint64_t start_ns;
+	uint32_t frames;
+	uint64_t latency_ns;
+	uint64_t cpu_ns;
+	uint64_t update_ns;
+	uint64_t arena_bytes;
+	uint32_t gpu_frames;
+	uint64_t gpu_ns;
+} frame_stats;
+
+/* User plus system CPU time of the process. */
+static uint64_t
+get_process_cpu_ns(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull +
+		(uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+/* Process CPU usage in percent of one core since the last call, or since
+ * the mark was reset to 0.
+ */
+static struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} cpu_usage_mark;
+
+static double
+get_cpu_usage(void)
+{
+	uint64_t wall_ns = get_time_ns(), cpu_ns = get_process_cpu_ns();
+	double usage = 0.0;
+
+	if (cpu_usage_mark.wall_ns != 0 && wall_ns > cpu_usage_mark.wall_ns)
+	{
+		usage = 100.0 * (cpu_ns - cpu_usage_mark.cpu_ns) / (wall_ns - cpu_usage_mark.wall_ns);
+	}
+
+	cpu_usage_mark.wall_ns = wall_ns;
+	cpu_usage_mark.cpu_ns = cpu_ns;
+
+	return usage;
+}
 
 void
 failv(const char *format, va_list args)
@@ -101,22 +190,8 @@ xstrdup(const char *s)
 	// return dup;
 }
 
-static int find_image_memory(struct vkcube *vc, unsigned allowed)
-{
-	VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | (vc->protected_en ? VK_MEMORY_PROPERTY_PROTECTED_BIT : 0);
-
-	for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) 
-	{
-		if ((allowed & (1u << i)) && (vc->memory_properties.memoryTypes[i].propertyFlags & flags))
-		{
-			return i;
-		}
-	}
-	return -1;
-}
-
 static void
-init_vk(struct vkcube *vc, const char *extension)
+create_instance(struct vkcube *vc, const char *extension)
 {
 	VkResult res = vkCreateInstance(
 		&(VkInstanceCreateInfo) 
@@ -141,16 +216,288 @@ init_vk(struct vkcube *vc, const char *extension)
 		&vc->instance
 	);
 
-	fail_if(res != VK_SUCCESS, "Failed to create Vulkan instance.\n");
+	if (res != VK_SUCCESS)
+	{
+		fprintf(stderr, "failed to create Vulkan instance (%d)\n", res);
+		exit(1);
+	}
+}
+
+static const char *const device_type_names[] = {
+	[VK_PHYSICAL_DEVICE_TYPE_OTHER] = "other",
+	[VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU] = "integrated",
+	[VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU] = "discrete",
+	[VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU] = "virtual",
+	[VK_PHYSICAL_DEVICE_TYPE_CPU] = "cpu",
+};
+
+/* Preference by device type, the deciding part of the score. */
+static const uint32_t device_type_ranks[] = {
+	[VK_PHYSICAL_DEVICE_TYPE_OTHER] = 0,
+	[VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU] = 3,
+	[VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU] = 4,
+	[VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU] = 2,
+	[VK_PHYSICAL_DEVICE_TYPE_CPU] = 1,
+};
+
+static VkDeviceSize
+get_device_local_size(VkPhysicalDevice pd)
+{
+	VkPhysicalDeviceMemoryProperties memory;
+	VkDeviceSize size = 0;
+
+	vkGetPhysicalDeviceMemoryProperties(pd, &memory);
+	for (uint32_t i = 0; i < memory.memoryHeapCount; i++)
+	{
+		if (memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+		{
+			size += memory.memoryHeaps[i].size;
+		}
+	}
+
+	return size;
+}
+
+static bool
+has_device_extension(VkPhysicalDevice pd, const char *name)
+{
+	uint32_t count = 0;
+
+	vkEnumerateDeviceExtensionProperties(pd, NULL, &count, NULL);
+	VkExtensionProperties extensions[count > 0 ? count : 1];
+	vkEnumerateDeviceExtensionProperties(pd, NULL, &count, extensions);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (streq(extensions[i].extensionName, name))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+struct queue_families {
+	uint32_t graphics, present, transfer;
+};
 
+/* Rate a physical device for rendering: device type first (discrete,
+ * integrated, virtual, CPU, other), then device-local memory in MiB.
+ * Returns -1 and sets *reason if the device cannot be used, i.e. it has no
+ * graphics queue family, or with a window no swapchain extension or no
+ * family that can present to the X connection.
+ *
+ * *families gets the families to use: graphics, preferably one that can
+ * also present; present, the graphics family if it can, else any family
+ * that can; transfer, a transfer-only family (a DMA engine) if there is one,
+ * else the graphics family.
+ */
+static int64_t
+score_device(struct vkcube *vc, VkPhysicalDevice pd, const char *extension,
+	struct queue_families *families, const char **reason)
+{
+	VkPhysicalDeviceProperties properties;
+	PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR get_xcb_presentation_support = NULL;
 	uint32_t count;
-	res = vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
-	fail_if(res != VK_SUCCESS || count == 0, "No Vulkan devices found.\n");
+
+	vkGetPhysicalDeviceProperties(pd, &properties);
+
+	if (extension && !has_device_extension(pd, VK_KHR_SWAPCHAIN_EXTENSION_NAME))
+	{
+		*reason = "no " VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+		return -1;
+	}
+
+	if (extension && vc->xcb.conn != NULL)
+	{
+		get_xcb_presentation_support = (PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR)
+			vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceXcbPresentationSupportKHR");
+	}
+
+	vkGetPhysicalDeviceQueueFamilyProperties(pd, &count, NULL);
+	VkQueueFamilyProperties props[count > 0 ? count : 1];
+	vkGetPhysicalDeviceQueueFamilyProperties(pd, &count, props);
+
+	families->graphics = UINT32_MAX;
+	families->present = UINT32_MAX;
+	families->transfer = UINT32_MAX;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		VkQueueFlags flags = props[i].queueFlags;
+		bool present = !get_xcb_presentation_support ||
+			get_xcb_presentation_support(pd, i, vc->xcb.conn, vc->xcb.visual);
+
+		if ((flags & VK_QUEUE_GRAPHICS_BIT) &&
+			(families->graphics == UINT32_MAX || (present && families->present != families->graphics)))
+		{
+			families->graphics = i;
+		}
+
+		if (present && (families->present == UINT32_MAX || i == families->graphics))
+		{
+			families->present = i;
+		}
+
+		if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+			families->transfer == UINT32_MAX)
+		{
+			families->transfer = i;
+		}
+	}
+
+	if (families->graphics == UINT32_MAX)
+	{
+		*reason = "no graphics queue family";
+		return -1;
+	}
+
+	if (families->present == UINT32_MAX)
+	{
+		*reason = "no queue family that can present to X";
+		return -1;
+	}
+
+	if (families->transfer == UINT32_MAX)
+	{
+		families->transfer = families->graphics;
+	}
+
+	uint32_t rank = properties.deviceType < ARRAY_SIZE(device_type_ranks) ?
+		device_type_ranks[properties.deviceType] : 0;
+
+	return ((int64_t) rank << 40) + (int64_t) (get_device_local_size(pd) >> 20);
+}
+
+/* --list-devices */
+static void
+list_devices(struct vkcube *vc)
+{
+	uint32_t count = 0;
+
+	vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
+	VkPhysicalDevice pd[count > 0 ? count : 1];
+	vkEnumeratePhysicalDevices(vc->instance, &count, pd);
+
+	printf("%u physical devices\n", count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		VkPhysicalDeviceProperties properties;
+		const char *reason = NULL;
+		struct queue_families families;
+		uint32_t family_count;
+
+		vkGetPhysicalDeviceProperties(pd[i], &properties);
+		int64_t score = score_device(vc, pd[i], NULL, &families, &reason);
+
+		printf("\n%u: %s\n", i, properties.deviceName);
+		printf("    type:           %s\n", properties.deviceType < ARRAY_SIZE(device_type_names) ?
+			device_type_names[properties.deviceType] : "unknown");
+		printf("    vendor/device:  %04x:%04x\n", properties.vendorID, properties.deviceID);
+		printf("    api version:    %u.%u.%u\n", VK_VERSION_MAJOR(properties.apiVersion),
+			VK_VERSION_MINOR(properties.apiVersion), VK_VERSION_PATCH(properties.apiVersion));
+		printf("    driver version: 0x%08x\n", properties.driverVersion);
+		printf("    device-local:   %lu MiB\n", (unsigned long) (get_device_local_size(pd[i]) >> 20));
+		printf("    swapchain:      %s\n",
+			has_device_extension(pd[i], VK_KHR_SWAPCHAIN_EXTENSION_NAME) ? "yes" : "no");
+
+		vkGetPhysicalDeviceQueueFamilyProperties(pd[i], &family_count, NULL);
+		VkQueueFamilyProperties props[family_count > 0 ? family_count : 1];
+		vkGetPhysicalDeviceQueueFamilyProperties(pd[i], &family_count, props);
+
+		for (uint32_t f = 0; f < family_count; f++)
+		{
+			printf("    queue family %u: %u queues,%s%s%s%s timestamp bits %u\n", f, props[f].queueCount,
+				props[f].queueFlags & VK_QUEUE_GRAPHICS_BIT ? " graphics" : "",
+				props[f].queueFlags & VK_QUEUE_COMPUTE_BIT ? " compute" : "",
+				props[f].queueFlags & VK_QUEUE_TRANSFER_BIT ? " transfer" : "",
+				props[f].queueFlags & VK_QUEUE_PROTECTED_BIT ? " protected" : "",
+				props[f].timestampValidBits);
+		}
+
+		if (score < 0)
+		{
+			printf("    unusable:       %s\n", reason);
+		}
+		else
+		{
+			printf("    score:          %ld\n", (long) score);
+			printf("    families:       graphics %u, transfer %u\n", families.graphics, families.transfer);
+		}
+	}
+}
+
+/* Pick the highest scoring device. --device restricts the choice to the
+ * device with that index or to those whose name contains the string.
+ */
+static void
+choose_physical_device(struct vkcube *vc, const char *extension)
+{
+	uint32_t count = 0;
+	int64_t best_score = -1;
+
+	vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
+	if (count == 0)
+	{
+		fprintf(stderr, "no Vulkan devices found\n");
+		exit(1);
+	}
 	VkPhysicalDevice pd[count];
 	vkEnumeratePhysicalDevices(vc->instance, &count, pd);
-	vc->physical_device = pd[1];
 	printf("%d physical devices\n", count);
 
+	for (uint32_t i = 0; i < count; i++)
+	{
+		VkPhysicalDeviceProperties properties;
+		const char *reason = NULL;
+		struct queue_families families;
+		char *end;
+
+		vkGetPhysicalDeviceProperties(pd[i], &properties);
+		int64_t score = score_device(vc, pd[i], extension, &families, &reason);
+
+		if (device_arg != NULL)
+		{
+			unsigned long index = strtoul(device_arg, &end, 10);
+			bool by_index = *device_arg != '\0' && *end == '\0';
+
+			if (by_index ? index != i : strstr(properties.deviceName, device_arg) == NULL)
+			{
+				continue;
+			}
+
+			if (score < 0 && by_index)
+			{
+				fprintf(stderr, "device %u (%s) cannot be used: %s\n", i, properties.deviceName, reason);
+				exit(1);
+			}
+		}
+
+		if (score > best_score)
+		{
+			best_score = score;
+			vc->physical_device = pd[i];
+			vc->queue_family = families.graphics;
+			vc->present_family = families.present;
+			vc->transfer_family = families.transfer;
+		}
+	}
+
+	if (best_score < 0)
+	{
+		fprintf(stderr, device_arg ? "no usable device matches --device %s\n" : "no usable Vulkan device%s\n",
+			device_arg ? device_arg : "");
+		exit(1);
+	}
+}
+
+static void
+init_vk(struct vkcube *vc, const char *extension)
+{
+	create_instance(vc, extension);
+	choose_physical_device(vc, extension);
+
 	VkPhysicalDeviceProtectedMemoryFeatures 
 	protected_features = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROTECTED_MEMORY_FEATURES,
@@ -171,34 +518,63 @@ init_vk(struct vkcube *vc, const char *extension)
 		
 	vc->protected_en = protected_chain && protected_features.protectedMemory;
 
-	VkPhysicalDeviceProperties properties;
-	vkGetPhysicalDeviceProperties(vc->physical_device, &properties);
-	printf("vendor id %04x, device name %s\n", properties.vendorID, properties.deviceName);
+	/* Protected buffers stay on the one protected queue. */
+	if (vc->protected_en)
+	{
+		vc->transfer_family = vc->queue_family;
+	}
+
+	/* Headless there is nothing to present. */
+	if (!extension)
+	{
+		vc->present_family = vc->queue_family;
+	}
+
+	vkGetPhysicalDeviceProperties(vc->physical_device, &vc->properties);
+	printf("vendor id %04x, device name %s\n", vc->properties.vendorID, vc->properties.deviceName);
 
 	vkGetPhysicalDeviceMemoryProperties(vc->physical_device, &vc->memory_properties);
 
+	uint32_t count;
 	vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, NULL);
-	assert(count > 0);
 	VkQueueFamilyProperties props[count];
 	vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
-	assert(props[0].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+	printf("queue families: graphics %u, present %u, transfer %u\n",
+		vc->queue_family, vc->present_family, vc->transfer_family);
+	vc->timestamp_valid_bits = props[vc->queue_family].timestampValidBits;
+
+	/* One queue per distinct family. */
+	VkDeviceQueueCreateInfo queue_infos[3];
+	uint32_t queue_info_count = 0;
+	uint32_t queue_families[3] = { vc->queue_family, vc->present_family, vc->transfer_family };
+
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		if (i > 0 && (queue_families[i] == queue_families[0] ||
+			(i == 2 && queue_families[2] == queue_families[1])))
+		{
+			continue;
+		}
+
+		queue_infos[queue_info_count++] = (VkDeviceQueueCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+			.queueFamilyIndex = queue_families[i],
+			.queueCount = 1,
+			.flags = i == 0 && vc->protected_en ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
+			.pQueuePriorities = (float []) { 1.0f },
+		};
+	}
 
 	vkCreateDevice(
 		vc->physical_device,
 		&(VkDeviceCreateInfo) 
 		{
 			.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-			.queueCreateInfoCount = 1,
-			.pQueueCreateInfos = 
-				&(VkDeviceQueueCreateInfo) 
-				{
-					.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-					.queueFamilyIndex = 0,
-					.queueCount = 1,
-					.flags = vc->protected_en ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
-					.pQueuePriorities = (float []) { 1.0f },
-				},
-			.enabledExtensionCount = 1,
+			.queueCreateInfoCount = queue_info_count,
+			.pQueueCreateInfos = queue_infos,
+			/* headless rendering needs no window system integration */
+			.enabledExtensionCount = extension ? 1 : 0,
 			.ppEnabledExtensionNames = 
 				(const char * const []) 
 				{
@@ -215,23 +591,69 @@ init_vk(struct vkcube *vc, const char *extension)
 		{
 			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_INFO_2,
 			.flags = vc->protected_en ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
-			.queueFamilyIndex = 0,
+			.queueFamilyIndex = vc->queue_family,
 			.queueIndex = 0,
 		}, 
 		&vc->queue
 	);
+
+	vc->present_queue = vc->queue;
+	if (vc->present_family != vc->queue_family)
+	{
+		vkGetDeviceQueue(vc->device, vc->present_family, 0, &vc->present_queue);
+	}
+
+	vc->transfer_queue = vc->queue;
+	if (vc->transfer_family != vc->queue_family)
+	{
+		vkGetDeviceQueue(vc->device, vc->transfer_family, 0, &vc->transfer_queue);
+	}
+
+	allocator_init(&vc->allocator, vc->device, &vc->memory_properties);
 }
 
 static void
 init_vk_objects(struct vkcube *vc)
 {
 	printf("vk creating render pass\n");
+	bool headless = display_mode == DISPLAY_MODE_HEADLESS;
+	bool depth = vc->depth_format != VK_FORMAT_UNDEFINED;
+
+	/* Headless frames are copied out right after the render pass. Each
+	 * buffer has its own depth image, cleared again while the buffer's
+	 * previous frame may still be writing it. That dependency replaces the
+	 * implicit one from EXTERNAL, so it also has to order the color layout
+	 * transition after the acquire semaphore wait at COLOR_ATTACHMENT_OUTPUT.
+	 */
+	VkSubpassDependency dependencies[] = {
+		{
+		.srcSubpass = 0,
+		.dstSubpass = VK_SUBPASS_EXTERNAL,
+		.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+		.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+		},
+		{
+		.srcSubpass = VK_SUBPASS_EXTERNAL,
+		.dstSubpass = 0,
+		.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+				VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+		.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+				VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+		.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+				VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+				VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		},
+	};
+
 	vkCreateRenderPass(
 		vc->device,
 		&(VkRenderPassCreateInfo) 
 		{
 			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-			.attachmentCount = 1,
+			.attachmentCount = depth ? 2 : 1,
 			.pAttachments = 
 				(VkAttachmentDescription[]) 
 				{
@@ -241,7 +663,17 @@ init_vk_objects(struct vkcube *vc)
 					.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
 					.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
 					.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-					.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+					.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+					},
+					{
+					.format = vc->depth_format,
+					.samples = 1,
+					.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+					.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+					.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+					.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+					.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+					.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
 					}
 				},
 			.subpassCount = 1,
@@ -264,12 +696,17 @@ init_vk_objects(struct vkcube *vc)
 							.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
 						}
 					},
-					.pDepthStencilAttachment = NULL,
+					.pDepthStencilAttachment = depth ?
+						&(VkAttachmentReference) {
+							.attachment = 1,
+							.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+						} : NULL,
 					.preserveAttachmentCount = 0,
 					.pPreserveAttachments = NULL,
 					}
 				},
-			.dependencyCount = 0
+			.dependencyCount = (headless ? 1 : 0) + (depth ? 1 : 0),
+			.pDependencies = headless ? &dependencies[0] : &dependencies[1],
 		},
 		NULL,
 		&vc->render_pass
@@ -278,18 +715,12 @@ init_vk_objects(struct vkcube *vc)
 	printf("done\n");
 	printf("function ptr : %p\n", vc->model.init);
 
-	// segfaults
-	// vc->model.init(vc);
-	init_cube(vc);
-
-	printf("vk model initialized\n");
-
 	vkCreateCommandPool(
 		vc->device,
 		&(const VkCommandPoolCreateInfo) 
 		{
 			.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-			.queueFamilyIndex = 0,
+			.queueFamilyIndex = vc->queue_family,
 			.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
 					(vc->protected_en ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0)
 		},
@@ -299,17 +730,170 @@ init_vk_objects(struct vkcube *vc)
 
 	printf("vk creating command pool\n");
 
-	vkCreateSemaphore(
+	if (vc->transfer_family != vc->queue_family)
+	{
+		vkCreateCommandPool(
+			vc->device,
+			&(const VkCommandPoolCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+				.queueFamilyIndex = vc->transfer_family,
+				.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+			},
+			NULL,
+			&vc->transfer_cmd_pool
+		);
+	}
+
+	/* Command pools are not thread safe, every recording thread gets one. */
+	for (uint32_t i = 0; i < vc->record_threads; i++)
+	{
+		vkCreateCommandPool(
+			vc->device,
+			&(const VkCommandPoolCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+				.queueFamilyIndex = vc->queue_family,
+				.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+						(vc->protected_en ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0)
+			},
+			NULL,
+			&vc->record_cmd_pools[i]
+		);
+	}
+
+	if (vc->record_threads > 0)
+	{
+		worker_pool_init(&vc->record_pool, vc->record_threads);
+	}
+
+	// segfaults
+	// vc->model.init(vc);
+	init_cube(vc);
+
+	printf("vk model initialized\n");
+
+	for (uint32_t i = 0; i < vc->frames_in_flight; i++)
+	{
+		struct vkcube_frame *frame = &vc->frames[i];
+
+		vkCreateSemaphore(
+			vc->device,
+			&(VkSemaphoreCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			},
+			NULL,
+			&frame->acquire_semaphore
+		);
+
+		vkCreateFence(
+			vc->device,
+			&(VkFenceCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+				.flags = VK_FENCE_CREATE_SIGNALED_BIT
+			},
+			NULL,
+			&frame->fence
+		);
+
+		frame->start_ns = 0;
+	}
+
+	vc->frame_index = 0;
+
+	printf("vk creating %u frames in flight\n", vc->frames_in_flight);
+
+	/* Timestamps are not allowed in protected command buffers. */
+	if (vc->timestamp_valid_bits > 0 && !vc->protected_en)
+	{
+		vkCreateQueryPool(
+			vc->device,
+			&(VkQueryPoolCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+				.queryType = VK_QUERY_TYPE_TIMESTAMP,
+				.queryCount = 2 * MAX_NUM_IMAGES,
+			},
+			NULL,
+			&vc->query_pool
+		);
+
+		printf("vk creating timestamp query pool\n");
+	}
+	else
+	{
+		vc->query_pool = VK_NULL_HANDLE;
+		printf("GPU timestamps not supported, GPU frame time unavailable\n");
+	}
+}
+
+/* Sub-allocate device-local memory for an optimal-tiling image and bind it. */
+static void
+bind_image_memory(struct vkcube *vc, VkImage image, struct allocation *allocation)
+{
+	VkMemoryRequirements reqs;
+	VkMemoryPropertyFlags required = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+		(vc->protected_en ? VK_MEMORY_PROPERTY_PROTECTED_BIT : 0);
+
+	vkGetImageMemoryRequirements(vc->device, image, &reqs);
+
+	if (alloc_memory(&vc->allocator, &reqs, required, 0, true, allocation) != VK_SUCCESS)
+	{
+		fprintf(stderr, "no suitable memory for a %lu byte image\n", (unsigned long) reqs.size);
+		exit(1);
+	}
+
+	vkBindImageMemory(vc->device, image, allocation->memory, allocation->offset);
+}
+
+/* Create the buffer's depth image, only used when instances may overlap. */
+static void
+init_depth(struct vkcube *vc, struct vkcube_buffer *b)
+{
+
+	vkCreateImage(
 		vc->device,
-		&(VkSemaphoreCreateInfo) 
+		&(VkImageCreateInfo) 
 		{
-			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+			.imageType = VK_IMAGE_TYPE_2D,
+			.format = vc->depth_format,
+			.extent = { vc->width, vc->height, 1 },
+			.mipLevels = 1,
+			.arrayLayers = 1,
+			.samples = VK_SAMPLE_COUNT_1_BIT,
+			.tiling = VK_IMAGE_TILING_OPTIMAL,
+			.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 		},
 		NULL,
-		&vc->semaphore
+		&b->depth_image
 	);
 
-	printf("vk creating semaphore\n");
+	bind_image_memory(vc, b->depth_image, &b->depth_alloc);
+
+	vkCreateImageView(
+		vc->device,
+		&(VkImageViewCreateInfo) 
+		{
+			.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+			.image = b->depth_image,
+			.viewType = VK_IMAGE_VIEW_TYPE_2D,
+			.format = vc->depth_format,
+			.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = 1,
+			},
+		},
+		NULL,
+		&b->depth_view
+	);
 }
 
 static void
@@ -341,14 +925,19 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 		&b->view
 	);
 
-	vkCreateFramebuffer(
+	if (vc->depth_format != VK_FORMAT_UNDEFINED)
+	{
+		init_depth(vc, b);
+	}
+
+	vkCreateFramebuffer(
 		vc->device,
 		&(VkFramebufferCreateInfo) 
 		{
 			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
 			.renderPass = vc->render_pass,
-			.attachmentCount = 1,
-			.pAttachments = &b->view,
+			.attachmentCount = vc->depth_format != VK_FORMAT_UNDEFINED ? 2 : 1,
+			.pAttachments = (VkImageView []) { b->view, b->depth_view },
 			.width = vc->width,
 			.height = vc->height,
 			.layers = 1
@@ -357,16 +946,13 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 		&b->framebuffer
 	);
 
-	vkCreateFence(
-		vc->device,
-		&(VkFenceCreateInfo) 
-		{
-			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-			.flags = VK_FENCE_CREATE_SIGNALED_BIT
-		},
-		NULL,
-		&b->fence
-	);
+	b->fence = VK_NULL_HANDLE;
+
+	/* Command buffers outlive the swapchain, recreation reuses them. */
+	if (b->cmd_buffers[0] != VK_NULL_HANDLE)
+	{
+		return;
+	}
 
 	vkAllocateCommandBuffers(
 		vc->device,
@@ -375,23 +961,172 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
 			.commandPool = vc->cmd_pool,
 			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-			.commandBufferCount = 1,
+			.commandBufferCount = vc->frames_in_flight,
 		},
-		&b->cmd_buffer
+		b->cmd_buffers
+	);
+
+	for (uint32_t slot = 0; slot < vc->frames_in_flight; slot++)
+	{
+		for (uint32_t i = 0; i < vc->record_threads; i++)
+		{
+			vkAllocateCommandBuffers(
+				vc->device,
+				&(VkCommandBufferAllocateInfo) 
+				{
+					.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+					.commandPool = vc->record_cmd_pools[i],
+					.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+					.commandBufferCount = 1,
+				},
+				&b->secondary[slot][i]
+			);
+		}
+	}
+}
+
+/* Free what init_buffer created for one swapchain image, except the command
+ * buffers. The buffer must be idle.
+ */
+static void
+destroy_buffer(struct vkcube *vc, struct vkcube_buffer *b)
+{
+	vkDestroyFramebuffer(vc->device, b->framebuffer, NULL);
+	vkDestroyImageView(vc->device, b->view, NULL);
+	b->framebuffer = VK_NULL_HANDLE;
+	b->view = VK_NULL_HANDLE;
+
+	if (b->depth_image != VK_NULL_HANDLE)
+	{
+		vkDestroyImageView(vc->device, b->depth_view, NULL);
+		vkDestroyImage(vc->device, b->depth_image, NULL);
+		alloc_free(&vc->allocator, &b->depth_alloc);
+		b->depth_view = VK_NULL_HANDLE;
+		b->depth_image = VK_NULL_HANDLE;
+	}
+}
+
+static void
+write_png(const char *path, uint32_t width, uint32_t height, uint32_t stride, const uint8_t *pixels)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "failed to open %s for writing\n", path);
+		return;
+	}
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
+
+	if (setjmp(png_jmpbuf(png)))
+	{
+		fprintf(stderr, "failed to write %s\n", path);
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return;
+	}
+
+	png_init_io(png, f);
+	png_set_IHDR(
+		png, info,
+		width, height, 8,
+		PNG_COLOR_TYPE_RGBA,
+		PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT
 	);
+	png_write_info(png, info);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		png_write_row(png, pixels + y * stride);
+	}
+
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	fclose(f);
+}
+
+/* A PNG file name is used as the printf format of the frame's path, so it may
+ * hold at most one %d, optionally with flags and a width, besides %%.
+ */
+static bool
+valid_out_file(const char *filename)
+{
+	size_t len = strlen(filename);
+	uint32_t conversions = 0;
+
+	if (len <= 4 || !streq(filename + len - 4, ".png"))
+	{
+		return true;
+	}
+
+	for (const char *p = filename; *p; p++)
+	{
+		if (*p != '%')
+		{
+			continue;
+		}
+
+		p++;
+		if (*p == '%')
+		{
+			continue;
+		}
+
+		p += strspn(p, "0-");
+		p += strspn(p, "0123456789");
+		if (*p != 'd' || ++conversions > 1)
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
+/* Write out the frame held in a headless buffer. Its fence must have
+ * signaled. A PNG file name may contain a %d for the frame number, see
+ * valid_out_file; any other extension streams raw RGBA frames into one file.
+ * An empty file name only renders.
+ */
 static void
 write_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 {
-	// const char *filename = arg_out_file;
-	// uint32_t mem_size = b->stride * vc->height;
-	// void *map;
+	const char *filename = arg_out_file;
+	size_t len = strlen(filename);
+
+	if (b->readback_frame < 0 || len == 0)
+	{
+		b->readback_frame = -1;
+		return;
+	}
+
+	if (len > 4 && streq(filename + len - 4, ".png"))
+	{
+		char path[4096];
+		snprintf(path, sizeof(path), filename, (int) b->readback_frame);
+
+		fprintf(stderr, "writing frame %d to %s\n", (int) b->readback_frame, path);
+		write_png(path, vc->width, vc->height, b->stride, b->readback_alloc.map);
+	}
+	else
+	{
+		if (!raw_out_file)
+		{
+			raw_out_file = fopen(filename, "wb");
+			if (!raw_out_file)
+			{
+				fprintf(stderr, "failed to open %s for writing\n", filename);
+				exit(1);
+			}
+		}
 
-	// vkMapMemory(vc->device, b->mem, 0, mem_size, 0, &map);
+		fwrite(b->readback_alloc.map, b->stride, vc->height, raw_out_file);
+	}
 
-	// fprintf(stderr, "writing first frame to %s\n", filename);
-	// // write_png(filename, vc->width, vc->height, b->stride, map);
+	b->readback_frame = -1;
 }
 
 /* Swapchain-based code - shared between XCB and Wayland */
@@ -434,15 +1169,40 @@ choose_surface_format(struct vkcube *vc)
 	return format;
 }
 
+/* (Re)create the swapchain for the current size. An existing swapchain is
+ * passed as oldSwapchain, so the presentation engine can hand over without
+ * a gap; only the frames still in flight on it are waited for before the
+ * views, framebuffers and depth buffers of its images are freed. Their
+ * render semaphores go with the old swapchain, as presents may still wait on
+ * them. Command buffers are kept and reused.
+ */
 static void
 create_swapchain(struct vkcube *vc)
 {
+	VkSwapchainKHR old_swap_chain = vc->swap_chain;
+
+	if (old_swap_chain != VK_NULL_HANDLE)
+	{
+		VkFence fences[MAX_FRAMES_IN_FLIGHT];
+
+		for (uint32_t i = 0; i < vc->frames_in_flight; i++)
+		{
+			fences[i] = vc->frames[i].fence;
+		}
+		vkWaitForFences(vc->device, vc->frames_in_flight, fences, VK_TRUE, UINT64_MAX);
+
+		for (uint32_t i = 0; i < vc->image_count; i++)
+		{
+			destroy_buffer(vc, &vc->buffers[i]);
+		}
+	}
+
 	VkSurfaceCapabilitiesKHR surface_caps;
 	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vc->physical_device, vc->surface, &surface_caps);
 	assert(surface_caps.supportedCompositeAlpha & VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR);
 
 	VkBool32 supported;
-	vkGetPhysicalDeviceSurfaceSupportKHR(vc->physical_device, 0, vc->surface, &supported);
+	vkGetPhysicalDeviceSurfaceSupportKHR(vc->physical_device, vc->present_family, vc->surface, &supported);
 	assert(supported);
 
 	uint32_t count;
@@ -451,18 +1211,28 @@ create_swapchain(struct vkcube *vc)
 	vkGetPhysicalDeviceSurfacePresentModesKHR(vc->physical_device, vc->surface, &count, present_modes);
 	int i;
 
+	/* FIFO is always supported. */
 	VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+	VkPresentModeKHR wanted = vc->requested_present_mode >= 0 ?
+		(VkPresentModeKHR) vc->requested_present_mode : VK_PRESENT_MODE_MAILBOX_KHR;
 
 	for (i = 0; i < count; i++) 
 	{
-		if (present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR) 
+		if (present_modes[i] == wanted) 
 		{
-			present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+			present_mode = wanted;
 			break;
 		}
 	}
 
-	uint32_t minImageCount = 2;
+	if (vc->requested_present_mode >= 0 && present_mode != wanted)
+	{
+		fprintf(stderr, "present mode '%s' is not supported, using 'fifo'\n",
+			present_mode_names[wanted]);
+	}
+	vc->present_mode = present_mode;
+
+	uint32_t minImageCount = vc->swap_image_count > 0 ? vc->swap_image_count : 2;
 	if (minImageCount < surface_caps.minImageCount) 
 	{
 		if (surface_caps.minImageCount > MAX_NUM_IMAGES)
@@ -491,17 +1261,37 @@ create_swapchain(struct vkcube *vc)
 			.imageExtent = { vc->width, vc->height },
 			.imageArrayLayers = 1,
 			.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-			.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-			.queueFamilyIndexCount = 1,
-			.pQueueFamilyIndices = (uint32_t[]) { 0 },
+			/* Concurrent between a separate graphics and present family, which
+			 * spares an ownership transfer per frame.
+			 */
+			.imageSharingMode = vc->present_family != vc->queue_family ?
+				VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+			.queueFamilyIndexCount = vc->present_family != vc->queue_family ? 2 : 1,
+			.pQueueFamilyIndices = (uint32_t[]) { vc->queue_family, vc->present_family },
 			.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
 			.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
 			.presentMode = present_mode,
+			.oldSwapchain = old_swap_chain,
 		}, 
 		NULL, 
 		&vc->swap_chain
 	);
 
+	/* Retired by the new one, its images are no longer in use by us. */
+	if (old_swap_chain != VK_NULL_HANDLE)
+	{
+		vkDestroySwapchainKHR(vc->device, old_swap_chain, NULL);
+
+		/* The frame fences do not cover the presents waiting on them. */
+		vkQueueWaitIdle(vc->present_queue);
+		for (uint32_t i = 0; i < vc->image_count; i++)
+		{
+			vkDestroySemaphore(vc->device, vc->buffers[i].render_semaphore, NULL);
+			vc->buffers[i].render_semaphore = VK_NULL_HANDLE;
+		}
+	}
+	vc->swap_chain_stale = false;
+
 	vkGetSwapchainImagesKHR(vc->device, vc->swap_chain, &vc->image_count, NULL);
 	assert(vc->image_count > 0);
 	VkImage swap_chain_images[vc->image_count];
@@ -512,140 +1302,1030 @@ create_swapchain(struct vkcube *vc)
 	{
 		vc->buffers[i].image = swap_chain_images[i];
 		init_buffer(vc, &vc->buffers[i]);
+
+		vkCreateSemaphore(
+			vc->device,
+			&(VkSemaphoreCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			},
+			NULL,
+			&vc->buffers[i].render_semaphore
+		);
+
+		for (uint32_t slot = 0; vc->prerecord && slot < vc->frames_in_flight; slot++)
+		{
+			record_cube(vc, &vc->buffers[i], slot);
+		}
 	}
 }
 
-/* XCB display code - render to X window */
-static xcb_atom_t
-get_atom(struct xcb_connection_t *conn, const char *name)
+/* Read back the render pass time of a retired frame. Returns false if the
+ * buffer has since been submitted again by another frame, which resets its
+ * queries.
+ */
+static bool
+get_gpu_time(struct vkcube *vc, struct vkcube_frame *frame, uint64_t *gpu_ns)
 {
-	xcb_intern_atom_cookie_t cookie;
-	xcb_intern_atom_reply_t *reply;
-	xcb_atom_t atom;
+	struct vkcube_buffer *b = frame->buffer;
+	uint64_t timestamps[2];
 
-	cookie = xcb_intern_atom(conn, 0, strlen(name), name);
-	reply = xcb_intern_atom_reply(conn, cookie, NULL);
+	if (vc->query_pool == VK_NULL_HANDLE || b == NULL || b->fence != frame->fence)
+	{
+		return false;
+	}
 
-	if (reply)
+	/* The fence has signaled, so this does not wait. */
+	VkResult result = vkGetQueryPoolResults(
+		vc->device,
+		vc->query_pool,
+		(b - vc->buffers) * 2, 2,
+		sizeof(timestamps), timestamps, sizeof(timestamps[0]),
+		VK_QUERY_RESULT_64_BIT
+	);
+
+	if (result != VK_SUCCESS)
 	{
-		atom = reply->atom;
+		return false;
 	}
-	else
+
+	uint64_t mask = vc->timestamp_valid_bits >= 64 ? UINT64_MAX : (1ull << vc->timestamp_valid_bits) - 1;
+	uint64_t ticks = (timestamps[1] - timestamps[0]) & mask;
+
+	*gpu_ns = ticks * (double) vc->properties.limits.timestampPeriod;
+	return true;
+}
+
+/* Highest use of any frame arena. */
+static VkDeviceSize
+get_arena_high_water(struct vkcube *vc)
+{
+	VkDeviceSize high_water = 0;
+
+	for (uint32_t i = 0; i < vc->frames_in_flight; i++)
 	{
-		atom = XCB_NONE;
+		if (vc->frames[i].arena.high_water > high_water)
+		{
+			high_water = vc->frames[i].arena.high_water;
+		}
 	}
 
-	free(reply);
-	return atom;
+	return high_water;
 }
 
-// Return -1 on failure.
-static int
-init_xcb(struct vkcube *vc)
+static void
+print_arena_stats(struct vkcube *vc, uint64_t bytes_per_frame)
 {
-	xcb_screen_iterator_t iter;
-	static const char title[] = "Vulkan Cube";
+	printf("frame arena: %lu bytes avg per frame, high water %lu of %lu bytes\n",
+		(unsigned long) bytes_per_frame,
+		(unsigned long) get_arena_high_water(vc),
+		(unsigned long) vc->frame_arena_size);
+}
 
-	vc->xcb.conn = xcb_connect(0, 0);
-	if (xcb_connection_has_error(vc->xcb.conn))
+/* Wait until the frame slot's previous frame has retired, accounting its
+ * latency and periodically reporting throughput.
+ */
+static void
+wait_frame(struct vkcube *vc, struct vkcube_frame *frame)
+{
+	uint64_t gpu_ns = 0;
+
+	vkWaitForFences(vc->device, 1, &frame->fence, VK_TRUE, UINT64_MAX);
+
+	uint64_t now = get_time_ns();
+	if (frame->start_ns == 0)
 	{
-		return -1;
+		return;
 	}
-	printf("xcb connection is ok\n");
 
-	vc->xcb.window = xcb_generate_id(vc->xcb.conn);
+	if (frame_stats.start_ns == 0)
+	{
+		frame_stats.start_ns = now;
+	}
 
-	printf("xcb id generated\n");
+	frame_stats.frames++;
+	frame_stats.latency_ns += now - frame->start_ns;
+	frame_stats.cpu_ns += frame->cpu_ns;
+	frame_stats.update_ns += frame->update_ns;
+	frame_stats.arena_bytes += frame->arena.used;
+	frame->start_ns = 0;
 
-	uint32_t window_values[] = {
-		XCB_EVENT_MASK_EXPOSURE |
-		XCB_EVENT_MASK_STRUCTURE_NOTIFY |
-		XCB_EVENT_MASK_KEY_PRESS
-	};
+	bool gpu_valid = get_gpu_time(vc, frame, &gpu_ns);
+	if (gpu_valid)
+	{
+		frame_stats.gpu_frames++;
+		frame_stats.gpu_ns += gpu_ns;
+	}
 
-	iter = xcb_setup_roots_iterator(xcb_get_setup(vc->xcb.conn));
+	if (frame->measured)
+	{
+		bench_add(&bench, BENCH_CPU, frame->cpu_ns);
+		if (vc->instance_count > 0)
+		{
+			bench_add(&bench, BENCH_UPDATE, frame->update_ns);
+		}
+		bench_add(&bench, BENCH_FENCE, now - frame->submit_ns);
+		if (gpu_valid)
+		{
+			bench_add(&bench, BENCH_GPU, gpu_ns);
+		}
+		frame->measured = false;
+	}
 
-	printf("xcb root iterator setup is ok\n");
+	uint64_t elapsed = now - frame_stats.start_ns;
+	if (elapsed >= STATS_INTERVAL_NS)
+	{
+		printf("%u frames in flight: %.1f fps, %.2f ms avg frame latency, "
+			"%.3f ms avg CPU per frame (%s), %.3f ms avg GPU per frame, %.1f%% process CPU\n",
+			vc->frames_in_flight,
+			frame_stats.frames * 1e9 / elapsed,
+			frame_stats.latency_ns / 1e6 / frame_stats.frames,
+			frame_stats.cpu_ns / 1e6 / frame_stats.frames,
+			vc->prerecord ? "pre-recorded" : "recorded per frame",
+			frame_stats.gpu_frames ? frame_stats.gpu_ns / 1e6 / frame_stats.gpu_frames : 0.0,
+			get_cpu_usage());
+		if (vc->instance_count > 0)
+		{
+			printf("%u instances: %.3f ms avg CPU update per frame\n",
+				vc->instance_count, frame_stats.update_ns / 1e6 / frame_stats.frames);
+		}
+		if (frame_stats.gpu_frames > 0)
+		{
+			uint64_t triangles = (uint64_t) vc->index_count / 3 * object_count(vc);
 
-	xcb_create_window(
-		vc->xcb.conn,
-		XCB_COPY_FROM_PARENT,
-		vc->xcb.window,
-		iter.data->root,
-		0, 0,
-		vc->width,
-		vc->height,
-		0,
-		XCB_WINDOW_CLASS_INPUT_OUTPUT,
-		iter.data->root_visual,
-		XCB_CW_EVENT_MASK, window_values
-	);
+			printf("%lu triangles per frame: %.1f M triangles/s on the GPU\n",
+				(unsigned long) triangles,
+				triangles * 1e3 * frame_stats.gpu_frames / frame_stats.gpu_ns);
+		}
+		print_arena_stats(vc, frame_stats.arena_bytes / frame_stats.frames);
+
+		frame_stats.start_ns = now;
+		frame_stats.frames = 0;
+		frame_stats.latency_ns = 0;
+		frame_stats.cpu_ns = 0;
+		frame_stats.update_ns = 0;
+		frame_stats.arena_bytes = 0;
+		frame_stats.gpu_frames = 0;
+		frame_stats.gpu_ns = 0;
+	}
+}
 
-	printf("xcb window is created\n");
+/* --fps-limit: wait until the next frame is due. clock_nanosleep() only
+ * gets within the scheduler's wake-up latency of the deadline, so it stops
+ * FPS_LIMIT_SPIN_NS short and the rest is spun. A frame more than one period
+ * late restarts the schedule instead of bursting to catch up.
+ */
+#define FPS_LIMIT_SPIN_NS 500000ull
 
-	vc->xcb.atom_wm_protocols = get_atom(vc->xcb.conn, "WM_PROTOCOLS");
-	vc->xcb.atom_wm_delete_window = get_atom(vc->xcb.conn, "WM_DELETE_WINDOW");
-	xcb_change_property(
-		vc->xcb.conn,
-		XCB_PROP_MODE_REPLACE,
-		vc->xcb.window,
-		vc->xcb.atom_wm_protocols,
-		XCB_ATOM_ATOM,
-		32,
-		1, &vc->xcb.atom_wm_delete_window
-	);
+static void
+limit_frame_rate(struct vkcube *vc)
+{
+	static uint64_t next_ns;
 
-	printf("xcb properties are changed\n");
+	if (vc->fps_limit == 0)
+	{
+		return;
+	}
 
-	xcb_change_property(
-		vc->xcb.conn,
-		XCB_PROP_MODE_REPLACE,
-		vc->xcb.window,
-		get_atom(vc->xcb.conn, "_NET_WM_NAME"),
-		get_atom(vc->xcb.conn, "UTF8_STRING"),
-		8, // sizeof(char),
-		strlen(title), title
-	);
+	uint64_t period_ns = 1000000000ull / vc->fps_limit;
+	uint64_t now = get_time_ns();
 
-	printf("xcb properties are changed\n");
+	if (next_ns == 0 || now > next_ns + period_ns)
+	{
+		next_ns = now + period_ns;
+		return;
+	}
 
-	xcb_map_window(vc->xcb.conn, vc->xcb.window);
+	if (now + FPS_LIMIT_SPIN_NS < next_ns)
+	{
+		uint64_t wake_ns = next_ns - FPS_LIMIT_SPIN_NS;
+		struct timespec wake = {
+			.tv_sec = wake_ns / 1000000000ull,
+			.tv_nsec = wake_ns % 1000000000ull,
+		};
 
-	printf("xcb window is mapped\n");
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		{
+		}
+	}
 
-	xcb_flush(vc->xcb.conn);
+	while (get_time_ns() < next_ns)
+	{
+	}
 
-	printf("xcb flushed\n");
+	next_ns += period_ns;
+}
 
-	init_vk(vc, VK_KHR_XCB_SURFACE_EXTENSION_NAME);
+/* Mark the start of a frame's CPU work, just before render_cube. */
+static void
+begin_frame(struct vkcube_frame *frame)
+{
+	static uint64_t last_start_ns;
+	uint64_t now = get_time_ns();
 
-	printf("xcb vk intialized\n");
+	frame->start_ns = now;
+	frame->measured = bench_frame(&bench, now);
 
-	PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR get_xcb_presentation_support = 
-		(PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR) 
-		vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceXcbPresentationSupportKHR");
+	if (frame->measured && last_start_ns != 0)
+	{
+		bench_add(&bench, BENCH_FRAME, now - last_start_ns);
+	}
 
-	PFN_vkCreateXcbSurfaceKHR create_xcb_surface = 
-		(PFN_vkCreateXcbSurfaceKHR) 
-		vkGetInstanceProcAddr(vc->instance, "vkCreateXcbSurfaceKHR");
+	last_start_ns = now;
+}
 
-	printf("vk pfn function calls passed\n");
+/* Retire all frames in flight and print the benchmark report. */
+static void
+report_bench(struct vkcube *vc)
+{
+	char config[2048];
 
-	if (
-		!get_xcb_presentation_support(
-			vc->physical_device, 0,
-			vc->xcb.conn,
-			iter.data->root_visual
-		)
-	) 
+	for (uint32_t i = 0; i < vc->frames_in_flight; i++)
 	{
-		fail("Vulkan not supported on given X window");
+		wait_frame(vc, &vc->frames[i]);
 	}
 
-	create_xcb_surface(
-		vc->instance,
-		&(VkXcbSurfaceCreateInfoKHR) 
-		{
+	snprintf(
+		config, sizeof(config),
+		"\"mode\":\"%s\",\"device\":\"%s\",\"width\":%u,\"height\":%u,"
+		"\"frames_in_flight\":%u,\"prerecord\":%s,"
+		"\"pipeline_cache\":\"%s\",\"pipeline_ms\":%.3f,"
+		"\"vertex_memory\":\"%s\",\"vertex_layout\":\"%s\",\"instances\":%u,"
+		"\"mesh_vertices\":%u,\"mesh_triangles\":%u,\"mesh_optimize\":\"%s\",\"acmr\":%.3f,"
+		"\"separate_draws\":%s,\"record_threads\":%u,"
+		"\"present_mode\":\"%s\",\"swap_images\":%u,\"fps_limit\":%u,"
+		"\"memory_blocks\":%u,\"memory_allocations\":%u,"
+		"\"arena_bytes\":%lu,\"arena_high_water\":%lu",
+		display_mode == DISPLAY_MODE_HEADLESS ? "headless" : "xcb",
+		vc->properties.deviceName,
+		vc->width, vc->height,
+		vc->frames_in_flight,
+		vc->prerecord ? "true" : "false",
+		!vc->use_pipeline_cache ? "none" : vc->pipeline_cache_warm ? "warm" : "cold",
+		vc->pipeline_ns / 1e6,
+		vc->host_vertices ? "host" : "device",
+		vertex_layout_names[vc->vertex_layout],
+		vc->instance_count > 0 ? vc->instance_count : 1,
+		vc->vertex_count,
+		vc->index_count / 3,
+		mesh_optimize_names[vc->mesh_optimize],
+		vc->mesh_acmr,
+		vc->separate_draws ? "true" : "false",
+		vc->record_threads,
+		display_mode == DISPLAY_MODE_HEADLESS ? "none" : present_mode_names[vc->present_mode],
+		vc->image_count,
+		vc->fps_limit,
+		vc->allocator.stats.blocks,
+		vc->allocator.stats.live_allocations,
+		(unsigned long) vc->frames[0].arena.used,
+		(unsigned long) get_arena_high_water(vc)
+	);
+
+	allocator_print_stats(&vc->allocator);
+	bench_report(&bench, config);
+}
+
+/* Time rounds passes of a benchmark kernel. */
+#define TIME_KERNEL(ns, rounds, body) \
+	do { \
+		uint64_t start = get_time_ns(); \
+		for (uint32_t round = 0; round < (rounds); round++) \
+		{ \
+			body; \
+			/* keep passes from being merged */ \
+			__asm__ volatile("" ::: "memory"); \
+		} \
+		(ns) = get_time_ns() - start; \
+	} while (0)
+
+/* --bench-matrix: compare the scalar matrix multiply with the compiled-in
+ * SIMD kernels and print their throughput, then exit.
+ */
+static void
+run_matrix_bench(void)
+{
+	const uint32_t count = 256, rounds = 32000;
+	ESMatrix *a = aligned_alloc(16, count * sizeof(ESMatrix));
+	ESMatrix *b = aligned_alloc(16, count * sizeof(ESMatrix));
+	ESMatrix *scalar = aligned_alloc(16, count * sizeof(ESMatrix));
+	ESMatrix *simd = aligned_alloc(16, count * sizeof(ESMatrix));
+	uint64_t ns[4];
+	float max_error = 0.0f;
+
+	srand(1);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (int j = 0; j < 16; j++)
+		{
+			a[i].m[j / 4][j % 4] = rand() / (float) RAND_MAX - 0.5f;
+			b[i].m[j / 4][j % 4] = rand() / (float) RAND_MAX - 0.5f;
+		}
+	}
+
+	TIME_KERNEL(ns[0], rounds,
+		for (uint32_t i = 0; i < count; i++) esMatrixMultiplyScalar(&scalar[i], &a[i], &b[i]));
+	TIME_KERNEL(ns[1], rounds,
+		for (uint32_t i = 0; i < count; i++) esMatrixMultiply(&simd[i], &a[i], &b[i]));
+	TIME_KERNEL(ns[2], rounds, esMatrixMultiplyBatch(simd, a, b, count));
+	TIME_KERNEL(ns[3], rounds, esMatrixMultiplyBatchShared(simd, a, b, count));
+
+	/* Check the batch against the scalar results; FMA rounds differently. */
+	esMatrixMultiplyBatch(simd, a, b, count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (int j = 0; j < 16; j++)
+		{
+			max_error = fmaxf(max_error, fabsf(simd[i].m[j / 4][j % 4] - scalar[i].m[j / 4][j % 4]));
+		}
+	}
+
+	static const char *const names[] = { "scalar", "single", "batch", "batch_shared" };
+	double total = (double) count * rounds;
+
+	printf("matrix multiply, %s kernels, %u x %u matrices, max error %g\n",
+		ES_MATRIX_SIMD, rounds, count, max_error);
+	for (int k = 0; k < 4; k++)
+	{
+		printf("%-14s %8.2f Mmat/s %7.2f ns/mat %5.2fx\n",
+			names[k], total / (ns[k] / 1e9) / 1e6, ns[k] / total, (double) ns[0] / ns[k]);
+	}
+
+	printf("BENCH {\"matrix_kernels\":\"%s\",\"matrices\":%.0f", ES_MATRIX_SIMD, total);
+	for (int k = 0; k < 4; k++)
+	{
+		printf(",\"%s_mmat_per_s\":%.3f", names[k], total / (ns[k] / 1e9) / 1e6);
+	}
+	printf("}\n");
+
+	free(a);
+	free(b);
+	free(scalar);
+	free(simd);
+}
+
+/* --bench-transforms: time transform_update() for 1k to 1M objects on 1 to
+ * max_threads threads against the per-object esTranslate/esRotate/
+ * esMatrixMultiply path, then exit.
+ */
+static void
+run_transform_bench(uint32_t max_threads)
+{
+	const uint32_t max_count = 1000000;
+	struct transform_batch batch = { 0 };
+	float **arrays[] = {
+		&batch.x, &batch.y, &batch.z,
+		&batch.axis_x, &batch.axis_y, &batch.axis_z, &batch.angle
+	};
+	struct ubo *out = aligned_alloc(64, max_count * sizeof(struct ubo));
+	ESMatrix view, projection;
+
+	for (unsigned a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++)
+	{
+		*arrays[a] = aligned_alloc(64, max_count * sizeof(float));
+	}
+
+	srand(1);
+	for (uint32_t i = 0; i < max_count; i++)
+	{
+		float ax = rand() / (float) RAND_MAX - 0.5f;
+		float ay = rand() / (float) RAND_MAX - 0.5f;
+		float az = rand() / (float) RAND_MAX + 0.1f;
+		float mag = sqrtf(ax * ax + ay * ay + az * az);
+
+		batch.x[i] = rand() / (float) RAND_MAX * 100.0f - 50.0f;
+		batch.y[i] = rand() / (float) RAND_MAX * 100.0f - 50.0f;
+		batch.z[i] = rand() / (float) RAND_MAX * 100.0f - 50.0f;
+		batch.axis_x[i] = ax / mag;
+		batch.axis_y[i] = ay / mag;
+		batch.axis_z[i] = az / mag;
+		batch.angle[i] = rand() / (float) RAND_MAX * 720.0f - 360.0f;
+	}
+
+	esMatrixLoadIdentity(&view);
+	esTranslate(&view, 0.0f, 0.0f, -150.0f);
+	esRotate(&view, 30.0f, 1.0f, 0.0f, 0.0f);
+	esMatrixLoadIdentity(&projection);
+	esFrustum(&projection, -40.0f, 40.0f, -30.0f, 30.0f, 60.0f, 240.0f);
+
+	printf("transform update, %d wide vectors\n", TRANSFORM_WIDTH);
+	printf("%8s %8s %10s %10s %8s\n", "objects", "threads", "ms/update", "Mobj/s", "speedup");
+
+	for (uint32_t count = 1000; count <= max_count; count *= 10)
+	{
+		uint32_t rounds = 4 * max_count / count;
+		double scalar_ns;
+		uint64_t ns;
+
+		batch.count = count;
+
+		/* The per-object path update_instances used before. */
+		TIME_KERNEL(ns, rounds,
+			for (uint32_t i = 0; i < count; i++)
+			{
+				struct ubo ubo;
+
+				ubo.modelview = view;
+				esTranslate(&ubo.modelview, batch.x[i], batch.y[i], batch.z[i]);
+				esRotate(&ubo.modelview, batch.angle[i], batch.axis_x[i], batch.axis_y[i], batch.axis_z[i]);
+				esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+				memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+				memcpy(&out[i], &ubo, sizeof(ubo));
+			});
+		scalar_ns = (double) ns / rounds;
+		printf("%8u %8s %10.3f %10.2f %7.2fx\n",
+			count, "scalar", scalar_ns / 1e6, count / scalar_ns * 1e3, 1.0);
+
+		/* Keep the scalar results to check the batched ones against. */
+		struct ubo *reference = malloc(count * sizeof(struct ubo));
+		if (!reference)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memcpy(reference, out, count * sizeof(struct ubo));
+
+		for (uint32_t threads = 1; threads <= max_threads; threads++)
+		{
+			struct worker_pool pool;
+			float max_error = 0.0f;
+
+			worker_pool_init(&pool, threads);
+			TIME_KERNEL(ns, rounds, transform_update(&pool, &batch, &view, &projection, out));
+			worker_pool_finish(&pool);
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				const float *a = (const float *) &out[i], *b = (const float *) &reference[i];
+
+				for (size_t j = 0; j < sizeof(struct ubo) / sizeof(float); j++)
+				{
+					max_error = fmaxf(max_error, fabsf(a[j] - b[j]));
+				}
+			}
+
+			printf("%8u %8u %10.3f %10.2f %7.2fx  max error %g\n",
+				count, threads, (double) ns / rounds / 1e6, count / ((double) ns / rounds) * 1e3,
+				scalar_ns / ((double) ns / rounds), max_error);
+			printf("BENCH {\"transform_objects\":%u,\"threads\":%u,\"width\":%d,"
+				"\"ms\":%.6f,\"scalar_ms\":%.6f}\n",
+				count, threads, TRANSFORM_WIDTH, (double) ns / rounds / 1e6, scalar_ns / 1e6);
+		}
+
+		free(reference);
+	}
+
+	for (unsigned a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++)
+	{
+		free(*arrays[a]);
+	}
+	free(out);
+}
+
+/* Copy the mesh out the way upload_mesh fills the staging buffer, so both
+ * loads of the mesh load benchmark read all of the data.
+ */
+static void
+copy_mesh(const struct mesh *mesh, uint8_t *dst)
+{
+	size_t vertex_bytes = (size_t) mesh->vertex_count * 3 * sizeof(float);
+
+	memcpy(dst, mesh->positions, vertex_bytes);
+	memcpy(dst + vertex_bytes, mesh->colors, vertex_bytes);
+	memcpy(dst + 2 * vertex_bytes, mesh->normals, vertex_bytes);
+	memcpy(dst + 3 * vertex_bytes, mesh->indices, mesh->index_count * sizeof(uint32_t));
+}
+
+/* --bench-mesh-load: load the --mesh OBJ or STL file by parsing it, convert
+ * it to a temporary .vkmesh and load that by mapping it, then exit. Both
+ * files are in the page cache by the time they are timed.
+ */
+static void
+run_mesh_load_bench(const char *path)
+{
+	char temp_path[] = "/tmp/vkcube-XXXXXX.vkmesh";
+	struct mesh mesh;
+	double parse_ns, map_ns;
+	uint64_t ns;
+	int fd;
+
+	if (path == NULL || !mesh_load(path, &mesh))
+	{
+		fprintf(stderr, "--bench-mesh-load needs a --mesh to load\n");
+		exit(1);
+	}
+	if (mesh.mapping != NULL)
+	{
+		fprintf(stderr, "--bench-mesh-load needs an OBJ or STL --mesh to compare with\n");
+		exit(1);
+	}
+
+	fd = mkstemps(temp_path, strlen(".vkmesh"));
+	if (fd < 0 || !mesh_save(temp_path, &mesh))
+	{
+		fprintf(stderr, "failed to write %s\n", temp_path);
+		exit(1);
+	}
+	close(fd);
+
+	uint32_t vertex_count = mesh.vertex_count, triangle_count = mesh.index_count / 3;
+	size_t size = (size_t) vertex_count * 9 * sizeof(float) + mesh.index_count * sizeof(uint32_t);
+	uint8_t *staging = malloc(size);
+	const uint32_t parse_rounds = 3, map_rounds = 20;
+
+	if (!staging)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	printf("mesh load, %u vertices, %u triangles, %.1f MiB of vertex and index data\n",
+		vertex_count, triangle_count, size / 1048576.0);
+	mesh_free(&mesh);
+
+	TIME_KERNEL(ns, parse_rounds,
+		mesh_load(path, &mesh);
+		copy_mesh(&mesh, staging);
+		mesh_free(&mesh));
+	parse_ns = (double) ns / parse_rounds;
+
+	TIME_KERNEL(ns, map_rounds,
+		mesh_load(temp_path, &mesh);
+		copy_mesh(&mesh, staging);
+		mesh_free(&mesh));
+	map_ns = (double) ns / map_rounds;
+
+	printf("%8s %10s %8s\n", "load", "ms", "speedup");
+	printf("%8s %10.3f %7.2fx\n", "parse", parse_ns / 1e6, 1.0);
+	printf("%8s %10.3f %7.2fx\n", "mapped", map_ns / 1e6, parse_ns / map_ns);
+	printf("BENCH {\"mesh_vertices\":%u,\"mesh_triangles\":%u,\"parse_ms\":%.6f,\"mapped_ms\":%.6f}\n",
+		vertex_count, triangle_count, parse_ns / 1e6, map_ns / 1e6);
+
+	unlink(temp_path);
+	free(staging);
+}
+
+/* --bench-alloc: a random mix of allocations and frees of buffer-sized
+ * requests (256 bytes to 1 MiB, 16 to 2048 byte alignment, device-local and
+ * host-visible) against a working set of slots, once through the
+ * sub-allocator and once with one vkAllocateMemory per request, then exit.
+ */
+static void
+run_alloc_bench(struct vkcube *vc)
+{
+	const uint32_t slots = 1024, ops = 200000;
+	struct allocation *allocations = calloc(slots, sizeof(*allocations));
+	VkDeviceMemory *memory = calloc(slots, sizeof(*memory));
+	uint32_t type_bits = vc->memory_properties.memoryTypeCount < 32 ?
+		(1u << vc->memory_properties.memoryTypeCount) - 1 : UINT32_MAX;
+	struct allocator *alloc = &vc->allocator;
+	uint64_t ns[2];
+
+	if (!allocations || !memory)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (int direct = 0; direct < 2; direct++)
+	{
+		/* Same sequence for both runs. */
+		srand(1);
+		uint64_t start = get_time_ns();
+
+		for (uint32_t i = 0; i < ops; i++)
+		{
+			uint32_t k = rand() % slots;
+			VkMemoryRequirements reqs = {
+				.size = (256u << (rand() % 13)) + rand() % 256,
+				.alignment = 16u << (rand() % 8),
+				.memoryTypeBits = type_bits,
+			};
+			VkMemoryPropertyFlags required = rand() % 2 ?
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT :
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+			VkResult result = VK_SUCCESS;
+
+			if (!direct && allocations[k].block)
+			{
+				alloc_free(alloc, &allocations[k]);
+			}
+			else if (!direct)
+			{
+				result = alloc_memory(alloc, &reqs, required, 0, false, &allocations[k]);
+			}
+			else if (memory[k] != VK_NULL_HANDLE)
+			{
+				vkFreeMemory(vc->device, memory[k], NULL);
+				memory[k] = VK_NULL_HANDLE;
+			}
+			else
+			{
+				int memory_type = alloc_find_memory_type(alloc, type_bits, required, 0);
+
+				if (memory_type < 0)
+				{
+					/* as alloc_memory fails without a suitable type */
+					result = VK_ERROR_FEATURE_NOT_PRESENT;
+				}
+				else
+				{
+					result = vkAllocateMemory(
+						vc->device,
+						&(VkMemoryAllocateInfo) 
+						{
+							.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+							.allocationSize = reqs.size,
+							.memoryTypeIndex = memory_type,
+						},
+						NULL,
+						&memory[k]
+					);
+				}
+			}
+
+			if (result != VK_SUCCESS)
+			{
+				fprintf(stderr, "allocation failed (%d)\n", result);
+				exit(1);
+			}
+		}
+
+		if (!direct)
+		{
+			allocator_print_stats(alloc);
+		}
+
+		for (uint32_t k = 0; k < slots; k++)
+		{
+			alloc_free(alloc, &allocations[k]);
+			if (memory[k] != VK_NULL_HANDLE)
+			{
+				vkFreeMemory(vc->device, memory[k], NULL);
+				memory[k] = VK_NULL_HANDLE;
+			}
+		}
+
+		ns[direct] = get_time_ns() - start;
+	}
+
+	printf("%u allocations and frees over %u slots:\n", ops, slots);
+	printf("  sub-allocator:    %8.1f ns/op\n", (double) ns[0] / ops);
+	printf("  vkAllocateMemory: %8.1f ns/op\n", (double) ns[1] / ops);
+	printf("BENCH {\"alloc_ops\":%u,\"slots\":%u,\"suballoc_ns\":%.1f,\"direct_ns\":%.1f,"
+		"\"device_allocations\":%lu}\n",
+		ops, slots, (double) ns[0] / ops, (double) ns[1] / ops,
+		(unsigned long) alloc->stats.device_allocations);
+
+	free(allocations);
+	free(memory);
+}
+
+/* --bench-record: time recording one frame's command buffers inline and with
+ * secondary command buffers on 1 to vc->record_threads threads, then exit.
+ * Nothing is submitted.
+ */
+static void
+run_record_bench(struct vkcube *vc)
+{
+	const uint32_t rounds = 200;
+	struct vkcube_buffer *b = &vc->buffers[0];
+	double inline_ns = 0.0;
+	uint64_t ns;
+
+	printf("recording %u objects, %s\n", object_count(vc),
+		vc->separate_draws ? "one draw each" : "instanced draws");
+	printf("%8s %10s %8s\n", "threads", "ms/frame", "speedup");
+
+	worker_pool_finish(&vc->record_pool);
+
+	for (uint32_t threads = 0; threads <= vc->record_threads; threads++)
+	{
+		/* 0 threads records inline into the primary */
+		memset(&vc->record_pool, 0, sizeof(vc->record_pool));
+		if (threads > 0)
+		{
+			worker_pool_init(&vc->record_pool, threads);
+		}
+
+		TIME_KERNEL(ns, rounds, record_cube(vc, b, 0));
+
+		if (threads == 0)
+		{
+			inline_ns = (double) ns / rounds;
+			printf("%8s %10.3f %7.2fx\n", "inline", inline_ns / 1e6, 1.0);
+		}
+		else
+		{
+			printf("%8u %10.3f %7.2fx\n", threads, (double) ns / rounds / 1e6, inline_ns / ((double) ns / rounds));
+			worker_pool_finish(&vc->record_pool);
+		}
+
+		printf("BENCH {\"record_objects\":%u,\"separate_draws\":%s,\"threads\":%u,\"ms\":%.6f}\n",
+			object_count(vc), vc->separate_draws ? "true" : "false", threads, (double) ns / rounds / 1e6);
+	}
+}
+
+/* Headless code - render offscreen and write frames to files */
+static int
+init_headless(struct vkcube *vc)
+{
+	init_vk(vc, NULL);
+
+	/* Byte order matches PNG and raw RGBA output. */
+	vc->image_format = VK_FORMAT_R8G8B8A8_SRGB;
+
+	init_vk_objects(vc);
+
+	/* One image per frame in flight is enough, nothing holds on to them. */
+	vc->image_count = vc->frames_in_flight;
+
+	for (uint32_t i = 0; i < vc->image_count; i++)
+	{
+		struct vkcube_buffer *b = &vc->buffers[i];
+
+		vkCreateImage(
+			vc->device,
+			&(VkImageCreateInfo) 
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+				.imageType = VK_IMAGE_TYPE_2D,
+				.format = vc->image_format,
+				.extent = { vc->width, vc->height, 1 },
+				.mipLevels = 1,
+				.arrayLayers = 1,
+				.samples = VK_SAMPLE_COUNT_1_BIT,
+				.tiling = VK_IMAGE_TILING_OPTIMAL,
+				.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+				.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+				.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			},
+			NULL,
+			&b->image
+		);
+
+		bind_image_memory(vc, b->image, &b->image_alloc);
+
+		b->stride = vc->width * 4;
+
+		create_buffer(vc, b->stride * vc->height, VK_BUFFER_USAGE_TRANSFER_DST_BIT, true,
+			&b->readback, &b->readback_alloc);
+		b->readback_frame = -1;
+
+		init_buffer(vc, b);
+
+		for (uint32_t slot = 0; vc->prerecord && slot < vc->frames_in_flight; slot++)
+		{
+			record_cube(vc, b, slot);
+		}
+	}
+
+	return 0;
+}
+
+static void
+mainloop_headless(struct vkcube *vc)
+{
+	uint32_t n;
+
+	get_cpu_usage();
+
+	for (n = 0; bench.enabled ? !bench_done(&bench) : n < frame_count; n++)
+	{
+		limit_frame_rate(vc);
+
+		struct vkcube_frame *frame = &vc->frames[vc->frame_index];
+		wait_frame(vc, frame);
+
+		struct vkcube_buffer *b = &vc->buffers[n % vc->image_count];
+		if (b->readback_frame >= 0)
+		{
+			vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+			write_buffer(vc, b);
+		}
+
+		begin_frame(frame);
+		render_cube(vc, b, false);
+		b->readback_frame = n;
+
+		vc->frame_index = (vc->frame_index + 1) % vc->frames_in_flight;
+	}
+
+	if (bench.enabled)
+	{
+		report_bench(vc);
+	}
+
+	vkDeviceWaitIdle(vc->device);
+
+	/* Flush the frames still held by the images, oldest first. */
+	for (uint32_t i = n > vc->image_count ? n - vc->image_count : 0; i < n; i++)
+	{
+		write_buffer(vc, &vc->buffers[i % vc->image_count]);
+	}
+
+	if (raw_out_file)
+	{
+		fclose(raw_out_file);
+	}
+}
+
+/* Destroy everything created on the device, then the device and instance.
+ * The allocator's blocks are freed last, once nothing is bound to them.
+ */
+static void
+finish_vk(struct vkcube *vc)
+{
+	vkDeviceWaitIdle(vc->device);
+
+	for (uint32_t i = 0; i < vc->image_count; i++)
+	{
+		struct vkcube_buffer *b = &vc->buffers[i];
+
+		destroy_buffer(vc, b);
+		vkDestroySemaphore(vc->device, b->render_semaphore, NULL);
+
+		/* headless images are ours, swapchain images go with it */
+		if (b->readback != VK_NULL_HANDLE)
+		{
+			vkDestroyBuffer(vc->device, b->readback, NULL);
+			vkDestroyImage(vc->device, b->image, NULL);
+		}
+	}
+
+	if (vc->swap_chain != VK_NULL_HANDLE)
+	{
+		vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
+	}
+
+	for (uint32_t i = 0; i < vc->frames_in_flight; i++)
+	{
+		vkDestroySemaphore(vc->device, vc->frames[i].acquire_semaphore, NULL);
+		vkDestroyFence(vc->device, vc->frames[i].fence, NULL);
+	}
+
+	vkDestroyQueryPool(vc->device, vc->query_pool, NULL);
+	vkDestroyPipeline(vc->device, vc->pipeline, NULL);
+	vkDestroyPipelineCache(vc->device, vc->pipeline_cache, NULL);
+	vkDestroyPipelineLayout(vc->device, vc->pipeline_layout, NULL);
+	vkDestroyDescriptorPool(vc->device, vc->descriptor_pool, NULL);
+	vkDestroyDescriptorSetLayout(vc->device, vc->set_layout, NULL);
+	vkDestroyRenderPass(vc->device, vc->render_pass, NULL);
+	vkDestroyBuffer(vc->device, vc->frame_buffer, NULL);
+	vkDestroyBuffer(vc->device, vc->vertex_buffer, NULL);
+	vkDestroyBuffer(vc->device, vc->index_buffer, NULL);
+
+	/* frees the command buffers allocated from them */
+	vkDestroyCommandPool(vc->device, vc->cmd_pool, NULL);
+	vkDestroyCommandPool(vc->device, vc->transfer_cmd_pool, NULL);
+	for (uint32_t i = 0; i < vc->record_threads; i++)
+	{
+		vkDestroyCommandPool(vc->device, vc->record_cmd_pools[i], NULL);
+	}
+
+	allocator_finish(&vc->allocator);
+	vkDestroyDevice(vc->device, NULL);
+
+	if (vc->surface != VK_NULL_HANDLE)
+	{
+		vkDestroySurfaceKHR(vc->instance, vc->surface, NULL);
+	}
+	vkDestroyInstance(vc->instance, NULL);
+}
+
+/* XCB display code - render to X window */
+static xcb_atom_t
+get_atom(struct xcb_connection_t *conn, const char *name)
+{
+	xcb_intern_atom_cookie_t cookie;
+	xcb_intern_atom_reply_t *reply;
+	xcb_atom_t atom;
+
+	cookie = xcb_intern_atom(conn, 0, strlen(name), name);
+	reply = xcb_intern_atom_reply(conn, cookie, NULL);
+
+	if (reply)
+	{
+		atom = reply->atom;
+	}
+	else
+	{
+		atom = XCB_NONE;
+	}
+
+	free(reply);
+	return atom;
+}
+
+// Return -1 on failure.
+static int
+init_xcb(struct vkcube *vc)
+{
+	xcb_screen_iterator_t iter;
+	static const char title[] = "Vulkan Cube";
+
+	vc->xcb.conn = xcb_connect(0, 0);
+	if (xcb_connection_has_error(vc->xcb.conn))
+	{
+		return -1;
+	}
+	printf("xcb connection is ok\n");
+
+	vc->xcb.window = xcb_generate_id(vc->xcb.conn);
+
+	printf("xcb id generated\n");
+
+	uint32_t window_values[] = {
+		XCB_EVENT_MASK_EXPOSURE |
+		XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+		XCB_EVENT_MASK_VISIBILITY_CHANGE |
+		XCB_EVENT_MASK_KEY_PRESS
+	};
+
+	iter = xcb_setup_roots_iterator(xcb_get_setup(vc->xcb.conn));
+	vc->xcb.visual = iter.data->root_visual;
+
+	printf("xcb root iterator setup is ok\n");
+
+	xcb_create_window(
+		vc->xcb.conn,
+		XCB_COPY_FROM_PARENT,
+		vc->xcb.window,
+		iter.data->root,
+		0, 0,
+		vc->width,
+		vc->height,
+		0,
+		XCB_WINDOW_CLASS_INPUT_OUTPUT,
+		iter.data->root_visual,
+		XCB_CW_EVENT_MASK, window_values
+	);
+
+	printf("xcb window is created\n");
+
+	vc->xcb.atom_wm_protocols = get_atom(vc->xcb.conn, "WM_PROTOCOLS");
+	vc->xcb.atom_wm_delete_window = get_atom(vc->xcb.conn, "WM_DELETE_WINDOW");
+	xcb_change_property(
+		vc->xcb.conn,
+		XCB_PROP_MODE_REPLACE,
+		vc->xcb.window,
+		vc->xcb.atom_wm_protocols,
+		XCB_ATOM_ATOM,
+		32,
+		1, &vc->xcb.atom_wm_delete_window
+	);
+
+	printf("xcb properties are changed\n");
+
+	xcb_change_property(
+		vc->xcb.conn,
+		XCB_PROP_MODE_REPLACE,
+		vc->xcb.window,
+		get_atom(vc->xcb.conn, "_NET_WM_NAME"),
+		get_atom(vc->xcb.conn, "UTF8_STRING"),
+		8, // sizeof(char),
+		strlen(title), title
+	);
+
+	printf("xcb properties are changed\n");
+
+	xcb_map_window(vc->xcb.conn, vc->xcb.window);
+	vc->xcb.mapped = true;
+
+	printf("xcb window is mapped\n");
+
+	xcb_flush(vc->xcb.conn);
+
+	printf("xcb flushed\n");
+
+	init_vk(vc, VK_KHR_XCB_SURFACE_EXTENSION_NAME);
+
+	printf("xcb vk intialized\n");
+
+	PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR get_xcb_presentation_support = 
+		(PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR) 
+		vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceXcbPresentationSupportKHR");
+
+	PFN_vkCreateXcbSurfaceKHR create_xcb_surface = 
+		(PFN_vkCreateXcbSurfaceKHR) 
+		vkGetInstanceProcAddr(vc->instance, "vkCreateXcbSurfaceKHR");
+
+	printf("vk pfn function calls passed\n");
+
+	if (
+		!get_xcb_presentation_support(
+			vc->physical_device, vc->present_family,
+			vc->xcb.conn,
+			vc->xcb.visual
+		)
+	) 
+	{
+		fail("Vulkan not supported on given X window");
+	}
+
+	create_xcb_surface(
+		vc->instance,
+		&(VkXcbSurfaceCreateInfoKHR) 
+		{
 			.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR,
 			.connection = vc->xcb.conn,
 			.window = vc->xcb.window,
@@ -654,158 +2334,368 @@ init_xcb(struct vkcube *vc)
 		&vc->surface
 	);
 
-	printf("xcb surface created\n");
+	printf("xcb surface created\n");
+
+	vc->image_format = choose_surface_format(vc);
+
+	printf("xcb surface format chosen\n");
+
+	init_vk_objects(vc);
+
+	printf("xcb vk objects initialized\n");
+
+	vc->image_count = 0;
+
+	return 0;
+}
+
+static void
+handle_xcb_event(struct vkcube *vc, xcb_generic_event_t *event)
+{
+	xcb_key_press_event_t *key_press;
+	xcb_client_message_event_t *client_message;
+	xcb_configure_notify_event_t *configure;
+	xcb_visibility_notify_event_t *visibility;
+
+	switch (event->response_type & 0x7f) 
+	{
+	case XCB_CLIENT_MESSAGE:
+		client_message = (xcb_client_message_event_t *) event;
+		if (client_message->window != vc->xcb.window)
+		{
+			break;
+		}
+
+		if (client_message->type == vc->xcb.atom_wm_protocols &&
+			client_message->data.data32[0] == vc->xcb.atom_wm_delete_window) 
+		{
+			exit(0);
+		}
+		break;
+
+	case XCB_CONFIGURE_NOTIFY:
+		configure = (xcb_configure_notify_event_t *) event;
+		if (vc->width != configure->width ||
+			vc->height != configure->height) 
+		{
+			vc->swap_chain_stale = true;
 
-	vc->image_format = choose_surface_format(vc);
+			vc->width = configure->width;
+			vc->height = configure->height;
+		}
+		break;
 
-	printf("xcb surface format chosen\n");
+	case XCB_MAP_NOTIFY:
+		vc->xcb.mapped = true;
+		break;
 
-	init_vk_objects(vc);
+	case XCB_UNMAP_NOTIFY:
+		vc->xcb.mapped = false;
+		break;
 
-	printf("xcb vk objects initialized\n");
+	case XCB_VISIBILITY_NOTIFY:
+		visibility = (xcb_visibility_notify_event_t *) event;
+		vc->xcb.obscured = visibility->state == XCB_VISIBILITY_FULLY_OBSCURED;
+		break;
 
-	vc->image_count = 0;
+	case XCB_KEY_PRESS:
+		key_press = (xcb_key_press_event_t *) event;
 
-	return 0;
+		if (key_press->detail == 9)
+		{
+			exit(0);
+		}
+
+		break;
+	}
 }
 
-static void
-schedule_xcb_repaint(struct vkcube *vc)
+/* --resize-storm N: resize the window to a new size after every frame, N
+ * times, then report what swapchain recreation cost and how resident memory
+ * developed, and exit. Exits with 1 if RSS grew by more than
+ * RESIZE_STORM_MAX_GROWTH_KIB after the first RESIZE_STORM_WARMUP resizes,
+ * which is long enough for allocations to settle.
+ */
+#define RESIZE_STORM_WARMUP 16
+#define RESIZE_STORM_MAX_GROWTH_KIB 4096
+/* frames rendered after the last resize so its ConfigureNotify arrives */
+#define RESIZE_STORM_DRAIN_FRAMES 10
+
+static struct {
+	uint32_t resizes;
+	uint32_t sent;
+	uint32_t drain;
+	uint32_t recreations;
+	uint64_t recreate_ns, recreate_max_ns;
+	uint32_t frames;
+	uint64_t last_frame_ns, frame_ns, frame_max_ns;
+	uint64_t rss_start_kib, rss_warm_kib;
+} resize_storm;
+
+static uint64_t
+get_rss_kib(void)
 {
-	xcb_client_message_event_t client_message;
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
 
-	client_message.response_type = XCB_CLIENT_MESSAGE;
-	client_message.format = 32;
-	client_message.window = vc->xcb.window;
-	client_message.type = XCB_ATOM_NOTICE;
+	if (f != NULL)
+	{
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		{
+			resident = 0;
+		}
+		fclose(f);
+	}
 
-	xcb_send_event(vc->xcb.conn, 0, vc->xcb.window, 0, (char *) &client_message);
-	xcb_flush(vc->xcb.conn);
+	return (uint64_t) resident * sysconf(_SC_PAGESIZE) / 1024;
 }
 
 static void
-mainloop_xcb(struct vkcube *vc)
+resize_storm_recreated(uint64_t ns)
 {
-	xcb_generic_event_t *event;
-	xcb_key_press_event_t *key_press;
-	xcb_client_message_event_t *client_message;
-	xcb_configure_notify_event_t *configure;
+	if (resize_storm.resizes == 0)
+	{
+		return;
+	}
 
-	while (1) 
+	resize_storm.recreations++;
+	resize_storm.recreate_ns += ns;
+	if (ns > resize_storm.recreate_max_ns)
+	{
+		resize_storm.recreate_max_ns = ns;
+	}
+}
+
+/* Called after every presented frame. */
+static void
+resize_storm_frame(struct vkcube *vc)
+{
+	uint64_t now = get_time_ns();
+
+	if (resize_storm.resizes == 0)
+	{
+		return;
+	}
+
+	if (resize_storm.last_frame_ns != 0)
 	{
-		// printf("looptydoop\n");
-		bool repaint = true;
-		event = xcb_wait_for_event(vc->xcb.conn);
-		while (event) 
+		uint64_t ns = now - resize_storm.last_frame_ns;
+
+		resize_storm.frames++;
+		resize_storm.frame_ns += ns;
+		if (ns > resize_storm.frame_max_ns)
 		{
-			switch (event->response_type & 0x7f) 
-			{
-			case XCB_CLIENT_MESSAGE:
-				client_message = (xcb_client_message_event_t *) event;
-				if (client_message->window != vc->xcb.window)
-				{
-					break;
-				}
+			resize_storm.frame_max_ns = ns;
+		}
+	}
+	else
+	{
+		resize_storm.rss_start_kib = get_rss_kib();
+	}
+	resize_storm.last_frame_ns = now;
 
+	if (resize_storm.sent == RESIZE_STORM_WARMUP)
+	{
+		resize_storm.rss_warm_kib = get_rss_kib();
+	}
 
-				if (client_message->type == vc->xcb.atom_wm_protocols &&
-					client_message->data.data32[0] == vc->xcb.atom_wm_delete_window) 
-				{
-					exit(0);
-				}
+	if (resize_storm.sent < resize_storm.resizes)
+	{
+		/* Walk through sizes between 200x150 and 799x599. */
+		uint32_t n = resize_storm.sent++;
 
-				if (client_message->type == XCB_ATOM_NOTICE)
-				{
-					repaint = true;
-				}
-				break;
+		xcb_configure_window(
+			vc->xcb.conn,
+			vc->xcb.window,
+			XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+			(uint32_t[]) { 200 + n * 97 % 600, 150 + n * 61 % 450 }
+		);
+		return;
+	}
 
-			case XCB_CONFIGURE_NOTIFY:
-				configure = (xcb_configure_notify_event_t *) event;
-				if (vc->width != configure->width ||
-					vc->height != configure->height) 
-				{
-					if (vc->image_count > 0) 
-					{
-						vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
-						vc->image_count = 0;
-					}
+	if (++resize_storm.drain < RESIZE_STORM_DRAIN_FRAMES)
+	{
+		return;
+	}
 
-					vc->width = configure->width;
-					vc->height = configure->height;
-				}
-				break;
+	uint64_t rss_end_kib = get_rss_kib();
+	uint64_t rss_warm_kib = resize_storm.rss_warm_kib ? resize_storm.rss_warm_kib : resize_storm.rss_start_kib;
+	int64_t growth_kib = (int64_t) rss_end_kib - (int64_t) rss_warm_kib;
+	double recreate_ms = resize_storm.recreations ? resize_storm.recreate_ns / 1e6 / resize_storm.recreations : 0.0;
+	double frame_ms = resize_storm.frames ? resize_storm.frame_ns / 1e6 / resize_storm.frames : 0.0;
+
+	printf("\nresize storm: %u resizes, %u swapchain recreations, %.3f ms avg, %.3f ms max per recreation\n",
+		resize_storm.sent, resize_storm.recreations, recreate_ms, resize_storm.recreate_max_ns / 1e6);
+	printf("frame time: %.3f ms avg, %.3f ms max over %u frames\n",
+		frame_ms, resize_storm.frame_max_ns / 1e6, resize_storm.frames);
+	printf("RSS: %lu KiB at start, %lu KiB after warm-up, %lu KiB at end (%+ld KiB)\n",
+		(unsigned long) resize_storm.rss_start_kib, (unsigned long) rss_warm_kib,
+		(unsigned long) rss_end_kib, (long) growth_kib);
+	printf("BENCH {\"resize_storm\":%u,\"recreations\":%u,\"recreate_ms\":%.6f,\"recreate_max_ms\":%.6f,"
+		"\"frame_ms\":%.6f,\"frame_max_ms\":%.6f,\"rss_start_kib\":%lu,\"rss_warm_kib\":%lu,\"rss_end_kib\":%lu}\n",
+		resize_storm.sent, resize_storm.recreations, recreate_ms, resize_storm.recreate_max_ns / 1e6,
+		frame_ms, resize_storm.frame_max_ns / 1e6,
+		(unsigned long) resize_storm.rss_start_kib, (unsigned long) rss_warm_kib, (unsigned long) rss_end_kib);
+	fflush(stdout);
+
+	if (growth_kib > RESIZE_STORM_MAX_GROWTH_KIB)
+	{
+		fprintf(stderr, "RSS grew by %ld KiB during the resize storm\n", (long) growth_kib);
+		exit(1);
+	}
+	exit(0);
+}
+
+/* Upper bound on blocking in vkAcquireNextImageKHR, so X events are still
+ * handled when the presentation engine holds on to all images, e.g. while
+ * the window is occluded under FIFO.
+ */
+#define ACQUIRE_TIMEOUT_NS 100000000ull
 
-			case XCB_EXPOSE:
-				schedule_xcb_repaint(vc);
-				break;
+/* Rendering runs free, throttled by acquire and present. X events are
+ * drained without blocking before every frame, so no frame waits on the X
+ * server. While there is nothing to draw (unmapped, fully obscured or zero
+ * sized) the loop sleeps in poll() on the connection until the next event,
+ * waking every STATS_INTERVAL_NS to report the CPU usage meanwhile.
+ */
+static void
+mainloop_xcb(struct vkcube *vc)
+{
+	xcb_generic_event_t *event;
+	struct pollfd pfd = {
+		.fd = xcb_get_file_descriptor(vc->xcb.conn),
+		.events = POLLIN,
+	};
 
-			case XCB_KEY_PRESS:
-				key_press = (xcb_key_press_event_t *) event;
+	bool idle = false;
 
-				if (key_press->detail == 9)
-				{
-					exit(0);
-				}
+	get_cpu_usage();
 
-				break;
-			}
+	while (1) 
+	{
+		while ((event = xcb_poll_for_event(vc->xcb.conn)) != NULL)
+		{
+			handle_xcb_event(vc, event);
 			free(event);
+		}
 
-			event = xcb_poll_for_event(vc->xcb.conn);
+		if (xcb_connection_has_error(vc->xcb.conn))
+		{
+			return;
 		}
 
-		if (repaint) 
+		if (!vc->xcb.mapped || vc->xcb.obscured || vc->width == 0 || vc->height == 0)
 		{
-			if (vc->image_count == 0)
+			if (!idle)
 			{
-				create_swapchain(vc);
+				printf("window hidden, not rendering\n");
+				idle = true;
+				get_cpu_usage();
 			}
 
-			uint32_t index;
-			VkResult result;
-			result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, 60, vc->semaphore, VK_NULL_HANDLE, &index);
-
-			switch (result)
+			int ret = poll(&pfd, 1, STATS_INTERVAL_NS / 1000000);
+			if (ret == -1 && errno != EINTR)
 			{
-			case VK_SUCCESS:
-				break;
-			case VK_NOT_READY: /* try later */
-			case VK_TIMEOUT:   /* try later */
-			case VK_ERROR_OUT_OF_DATE_KHR: /* handled by native events */
-				schedule_xcb_repaint(vc);
-				continue;
-			default:
 				return;
 			}
+			if (ret == 0)
+			{
+				printf("idle: %.2f%% process CPU\n", get_cpu_usage());
+			}
+			continue;
+		}
 
-			// // assert(index <= MAX_NUM_IMAGES);
-			// printf("rendering\n");
-			// vc->model.render(vc, &vc->buffers[index], true);
-			render_cube(vc, &vc->buffers[index], true);
+		if (idle)
+		{
+			printf("window visible, rendering\n");
+			idle = false;
+			get_cpu_usage();
+		}
 
-			vkQueuePresentKHR(
-				vc->queue,
-				&(VkPresentInfoKHR) 
-				{
-					.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-					.swapchainCount = 1,
-					.pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-					.pImageIndices = (uint32_t[]) { index, },
-					.pResults = &result,
-				}
-			);
+		if (vc->image_count == 0 || vc->swap_chain_stale)
+		{
+			uint64_t recreate_ns = get_time_ns();
+			create_swapchain(vc);
+			resize_storm_recreated(get_time_ns() - recreate_ns);
+		}
 
-			// printf("finished rendering\n");
+		limit_frame_rate(vc);
 
-			vkQueueWaitIdle(vc->queue);
+		struct vkcube_frame *frame = &vc->frames[vc->frame_index];
+		wait_frame(vc, frame);
 
-			schedule_xcb_repaint(vc);
+		uint32_t index;
+		VkResult result;
+		uint64_t acquire_ns = get_time_ns();
+		result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, ACQUIRE_TIMEOUT_NS, frame->acquire_semaphore, VK_NULL_HANDLE, &index);
+		acquire_ns = get_time_ns() - acquire_ns;
+
+		switch (result)
+		{
+		case VK_SUCCESS:
+			break;
+		case VK_SUBOPTIMAL_KHR:
+			/* The image is acquired and its semaphore will signal, so it
+			 * must still be rendered and presented.
+			 */
+			vc->swap_chain_stale = true;
+			break;
+		case VK_NOT_READY: /* handle events, then try again */
+		case VK_TIMEOUT:
+			continue;
+		case VK_ERROR_OUT_OF_DATE_KHR:
+			vc->swap_chain_stale = true;
+			continue;
+		default:
+			return;
 		}
 
-		xcb_flush(vc->xcb.conn);
+		begin_frame(frame);
+		render_cube(vc, &vc->buffers[index], true);
+
+		uint64_t present_ns = get_time_ns();
+		result = vkQueuePresentKHR(
+			vc->present_queue,
+			&(VkPresentInfoKHR) 
+			{
+				.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+				.waitSemaphoreCount = 1,
+				.pWaitSemaphores = &vc->buffers[index].render_semaphore,
+				.swapchainCount = 1,
+				.pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
+				.pImageIndices = (uint32_t[]) { index, },
+			}
+		);
+
+		switch (result)
+		{
+		case VK_SUCCESS:
+			break;
+		case VK_SUBOPTIMAL_KHR:
+		case VK_ERROR_OUT_OF_DATE_KHR:
+			vc->swap_chain_stale = true;
+			break;
+		default:
+			return;
+		}
+
+		if (frame->measured)
+		{
+			bench_add(&bench, BENCH_ACQUIRE, acquire_ns);
+			bench_add(&bench, BENCH_PRESENT, get_time_ns() - present_ns);
+		}
+
+		vc->frame_index = (vc->frame_index + 1) % vc->frames_in_flight;
+
+		if (bench_done(&bench))
+		{
+			report_bench(vc);
+			exit(0);
+		}
 
-		// printf("end of story\n");
+		resize_storm_frame(vc);
+
+		xcb_flush(vc->xcb.conn);
 	}
 }
 
@@ -815,18 +2705,432 @@ static int display_plane_idx = -1;
 
 extern struct model cube_model;
 
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: vkcube [options]\n"
+		"\n"
+		"  -m, --mode MODE            display mode, 'xcb' (default) or 'headless'\n"
+		"  -o, --out FILE             headless output, FILE.png (may contain %%d for the frame\n"
+		"                             number), any other name for raw RGBA, '' for none\n"
+		"  -n, --frame-count N        number of frames to render headless (default 1)\n"
+		"  -b, --bench N              render N frames after a warm-up, then print timing statistics\n"
+		"      --bench-seconds S      like --bench, but run for S seconds\n"
+		"  -f, --frames-in-flight N   frames the CPU may record ahead of the GPU (1-%d, default 2)\n"
+		"  -p, --prerecord            record command buffers once per swapchain, not per frame\n"
+		"      --device DEVICE        use the device with index DEVICE from --list-devices, or the best\n"
+		"                             one whose name contains DEVICE (default: best of all)\n"
+		"      --list-devices         print the Vulkan devices with their properties and score and exit\n"
+		"      --present-mode MODE    'immediate', 'mailbox', 'fifo' or 'fifo-relaxed' (default mailbox\n"
+		"                             if supported, else fifo)\n"
+		"      --swap-images N        request N swapchain images (2-%d, default 2)\n"
+		"      --fps-limit N          pace frames to at most N per second on the CPU\n"
+		"      --no-pipeline-cache    neither load nor save $XDG_CACHE_HOME/vkcube/pipeline_cache.bin\n"
+		"      --host-vertices        keep vertex data in host-visible instead of device-local memory\n"
+		"      --vertex-layout LAYOUT 'separate' (default, one binding per attribute), 'interleaved'\n"
+		"                             (36 byte vertices) or 'packed' (20 byte vertices)\n"
+		"      --mesh FILE            draw the Wavefront OBJ, binary STL or .vkmesh model FILE instead\n"
+		"                             of the cube\n"
+		"      --mesh-optimize MODE   reorder --mesh before upload: 'none' (default), 'cache' (vertex\n"
+		"                             cache and fetch order) or 'overdraw' (cache, then front-most\n"
+		"                             clusters first); reports the ACMR before and after\n"
+		"      --convert-mesh FILE    save --mesh as FILE in the .vkmesh format, which loads by\n"
+		"                             mapping instead of parsing, with --mesh-optimize applied, and exit\n"
+		"      --grid N               draw an animated NxNxN grid of cubes (N <= 64) in one instanced draw\n"
+		"      --update-threads N     threads computing the --grid transforms (1-%d, default 1)\n"
+		"      --separate-draws       with --grid, issue one draw per cube instead of one instanced draw\n"
+		"      --record-threads N     record the render pass into secondary command buffers on N threads\n"
+		"      --resize-storm N       resize the window after every frame N times, report swapchain\n"
+		"                             recreation time and RSS, fail if RSS keeps growing\n"
+		"      --bench-matrix         measure the matrix multiply kernels and exit\n"
+		"      --bench-transforms     measure the batched transform update on 1 to --update-threads\n"
+		"                             threads and exit\n"
+		"      --bench-mesh-load      compare loading the OBJ or STL --mesh with loading it\n"
+		"                             converted to .vkmesh and exit\n"
+		"      --bench-alloc          compare the device memory sub-allocator with one\n"
+		"                             vkAllocateMemory per allocation (headless setup) and exit\n"
+		"      --bench-record         measure command recording inline and on 1 to --record-threads\n"
+		"                             threads (headless setup, nothing is submitted) and exit\n"
+		"  -h, --help                 show this help\n",
+		MAX_FRAMES_IN_FLIGHT, MAX_NUM_IMAGES, MAX_WORKERS);
+	exit(1);
+}
+
+static uint32_t
+parse_uint(const char *arg, uint32_t min, uint32_t max)
+{
+	char *end;
+	unsigned long value = strtoul(arg, &end, 0);
+
+	if (*arg == '\0' || *end != '\0' || value < min || value > max)
+	{
+		fprintf(stderr, "invalid value '%s', expected %u-%u\n", arg, min, max);
+		usage();
+	}
+
+	return value;
+}
+
+enum {
+	OPT_BENCH_SECONDS = 256,
+	OPT_NO_PIPELINE_CACHE,
+	OPT_HOST_VERTICES,
+	OPT_VERTEX_LAYOUT,
+	OPT_GRID,
+	OPT_BENCH_MATRIX,
+	OPT_BENCH_TRANSFORMS,
+	OPT_UPDATE_THREADS,
+	OPT_SEPARATE_DRAWS,
+	OPT_RECORD_THREADS,
+	OPT_BENCH_RECORD,
+	OPT_PRESENT_MODE,
+	OPT_SWAP_IMAGES,
+	OPT_FPS_LIMIT,
+	OPT_RESIZE_STORM,
+	OPT_DEVICE,
+	OPT_LIST_DEVICES,
+	OPT_BENCH_ALLOC,
+	OPT_MESH,
+	OPT_CONVERT_MESH,
+	OPT_BENCH_MESH_LOAD,
+	OPT_MESH_OPTIMIZE,
+};
+
+static void
+parse_args(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "mode",             required_argument, NULL, 'm' },
+		{ "out",              required_argument, NULL, 'o' },
+		{ "frame-count",      required_argument, NULL, 'n' },
+		{ "bench",            required_argument, NULL, 'b' },
+		{ "bench-seconds",    required_argument, NULL, OPT_BENCH_SECONDS },
+		{ "frames-in-flight", required_argument, NULL, 'f' },
+		{ "prerecord",        no_argument,       NULL, 'p' },
+		{ "no-pipeline-cache", no_argument,      NULL, OPT_NO_PIPELINE_CACHE },
+		{ "host-vertices",    no_argument,       NULL, OPT_HOST_VERTICES },
+		{ "vertex-layout",    required_argument, NULL, OPT_VERTEX_LAYOUT },
+		{ "grid",             required_argument, NULL, OPT_GRID },
+		{ "bench-matrix",     no_argument,       NULL, OPT_BENCH_MATRIX },
+		{ "bench-transforms", no_argument,       NULL, OPT_BENCH_TRANSFORMS },
+		{ "update-threads",   required_argument, NULL, OPT_UPDATE_THREADS },
+		{ "separate-draws",   no_argument,       NULL, OPT_SEPARATE_DRAWS },
+		{ "record-threads",   required_argument, NULL, OPT_RECORD_THREADS },
+		{ "bench-record",     no_argument,       NULL, OPT_BENCH_RECORD },
+		{ "present-mode",     required_argument, NULL, OPT_PRESENT_MODE },
+		{ "swap-images",      required_argument, NULL, OPT_SWAP_IMAGES },
+		{ "fps-limit",        required_argument, NULL, OPT_FPS_LIMIT },
+		{ "resize-storm",     required_argument, NULL, OPT_RESIZE_STORM },
+		{ "device",           required_argument, NULL, OPT_DEVICE },
+		{ "list-devices",     no_argument,       NULL, OPT_LIST_DEVICES },
+		{ "bench-alloc",      no_argument,       NULL, OPT_BENCH_ALLOC },
+		{ "mesh",             required_argument, NULL, OPT_MESH },
+		{ "convert-mesh",     required_argument, NULL, OPT_CONVERT_MESH },
+		{ "bench-mesh-load",  no_argument,       NULL, OPT_BENCH_MESH_LOAD },
+		{ "mesh-optimize",    required_argument, NULL, OPT_MESH_OPTIMIZE },
+		{ "help",             no_argument,       NULL, 'h' },
+		{ 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "m:o:n:b:f:ph", longopts, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (streq(optarg, "headless"))
+			{
+				display_mode = DISPLAY_MODE_HEADLESS;
+			}
+			else if (streq(optarg, "xcb"))
+			{
+				display_mode = DISPLAY_MODE_XCB;
+			}
+			else
+			{
+				fprintf(stderr, "unsupported display mode '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'o':
+			arg_out_file = optarg;
+			if (!valid_out_file(optarg))
+			{
+				fprintf(stderr, "'%s' may only contain one %%d conversion\n", optarg);
+				usage();
+			}
+			break;
+		case 'n':
+			frame_count = parse_uint(optarg, 1, UINT32_MAX);
+			break;
+		case 'b':
+			bench.enabled = true;
+			bench.frames = parse_uint(optarg, 1, UINT32_MAX);
+			break;
+		case OPT_BENCH_SECONDS:
+			bench.enabled = true;
+			bench.frames = 0;
+			bench.seconds = parse_uint(optarg, 1, 24 * 3600);
+			break;
+		case 'f':
+			frames_in_flight = parse_uint(optarg, 1, MAX_FRAMES_IN_FLIGHT);
+			break;
+		case 'p':
+			prerecord = true;
+			break;
+		case OPT_NO_PIPELINE_CACHE:
+			use_pipeline_cache = false;
+			break;
+		case OPT_HOST_VERTICES:
+			host_vertices = true;
+			break;
+		case OPT_VERTEX_LAYOUT:
+			if (streq(optarg, "separate"))
+			{
+				vertex_layout = VERTEX_LAYOUT_SEPARATE;
+			}
+			else if (streq(optarg, "interleaved"))
+			{
+				vertex_layout = VERTEX_LAYOUT_INTERLEAVED;
+			}
+			else if (streq(optarg, "packed"))
+			{
+				vertex_layout = VERTEX_LAYOUT_PACKED;
+			}
+			else
+			{
+				fprintf(stderr, "unsupported vertex layout '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case OPT_GRID:
+			grid = parse_uint(optarg, 1, 64);
+			break;
+		case OPT_BENCH_MATRIX:
+			bench_matrix = true;
+			break;
+		case OPT_BENCH_TRANSFORMS:
+			bench_transforms = true;
+			break;
+		case OPT_UPDATE_THREADS:
+			update_threads = parse_uint(optarg, 1, MAX_WORKERS);
+			break;
+		case OPT_SEPARATE_DRAWS:
+			separate_draws = true;
+			break;
+		case OPT_RECORD_THREADS:
+			record_threads = parse_uint(optarg, 1, MAX_WORKERS);
+			break;
+		case OPT_BENCH_RECORD:
+			bench_record = true;
+			break;
+		case OPT_PRESENT_MODE:
+			present_mode = -1;
+			for (int i = 0; i < (int) ARRAY_SIZE(present_mode_names); i++)
+			{
+				if (streq(optarg, present_mode_names[i]))
+				{
+					present_mode = i;
+				}
+			}
+
+			if (present_mode == -1)
+			{
+				fprintf(stderr, "unsupported present mode '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case OPT_SWAP_IMAGES:
+			swap_image_count = parse_uint(optarg, 2, MAX_NUM_IMAGES);
+			break;
+		case OPT_FPS_LIMIT:
+			fps_limit = parse_uint(optarg, 1, 10000);
+			break;
+		case OPT_RESIZE_STORM:
+			resize_storm.resizes = parse_uint(optarg, 1, 1000000);
+			break;
+		case OPT_DEVICE:
+			device_arg = optarg;
+			break;
+		case OPT_LIST_DEVICES:
+			list_devices_only = true;
+			break;
+		case OPT_BENCH_ALLOC:
+			bench_alloc = true;
+			break;
+		case OPT_MESH:
+			mesh_path = optarg;
+			break;
+		case OPT_CONVERT_MESH:
+			convert_mesh_path = optarg;
+			break;
+		case OPT_BENCH_MESH_LOAD:
+			bench_mesh_load = true;
+			break;
+		case OPT_MESH_OPTIMIZE:
+			if (streq(optarg, "none"))
+			{
+				mesh_optimize_mode = MESH_OPTIMIZE_NONE;
+			}
+			else if (streq(optarg, "cache"))
+			{
+				mesh_optimize_mode = MESH_OPTIMIZE_CACHE;
+			}
+			else if (streq(optarg, "overdraw"))
+			{
+				mesh_optimize_mode = MESH_OPTIMIZE_OVERDRAW;
+			}
+			else
+			{
+				fprintf(stderr, "unsupported mesh optimization '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc)
+	{
+		usage();
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct vkcube vc;
 
+	parse_args(argc, argv);
+
+	if (bench_matrix)
+	{
+		run_matrix_bench();
+		return 0;
+	}
+
+	if (bench_transforms)
+	{
+		run_transform_bench(update_threads);
+		return 0;
+	}
+
+	if (bench_mesh_load)
+	{
+		run_mesh_load_bench(mesh_path);
+		return 0;
+	}
+
+	if (convert_mesh_path != NULL)
+	{
+		struct mesh mesh;
+		float acmr;
+
+		if (mesh_path == NULL)
+		{
+			fprintf(stderr, "--convert-mesh needs a --mesh to convert\n");
+			usage();
+		}
+		if (!load_mesh(mesh_path, mesh_optimize_mode, &mesh, &acmr) ||
+			!mesh_save(convert_mesh_path, &mesh))
+		{
+			return 1;
+		}
+		printf("%s: %u vertices, %u triangles\n", convert_mesh_path, mesh.vertex_count, mesh.index_count / 3);
+		mesh_free(&mesh);
+		return 0;
+	}
+
+	memset(&vc, 0, sizeof(vc));
+
+	if (list_devices_only)
+	{
+		create_instance(&vc, NULL);
+		list_devices(&vc);
+		return 0;
+	}
 	// vc.model = cube_model;
 	vc.gbm_device = NULL;
 	vc.xcb.window = XCB_NONE;
 	vc.width = width;
 	vc.height = height;
 	vc.protected_en = protected_chain;
+	vc.frames_in_flight = frames_in_flight;
+	vc.prerecord = prerecord;
+	vc.use_pipeline_cache = use_pipeline_cache;
+	vc.host_vertices = host_vertices;
+	vc.vertex_layout = vertex_layout;
+	vc.grid = grid;
+	vc.instance_count = grid * grid * grid;
+	vc.update_threads = update_threads;
+	vc.separate_draws = separate_draws;
+	vc.record_threads = record_threads;
+	vc.requested_present_mode = present_mode;
+	vc.swap_image_count = swap_image_count;
+	vc.fps_limit = fps_limit;
+	vc.mesh_path = mesh_path;
+	vc.mesh_optimize = mesh_optimize_mode;
+	/* D16 is the one depth format every implementation supports. Unlike
+	 * the cube, a loaded mesh need not be convex.
+	 */
+	vc.depth_format = grid > 0 || mesh_path ? VK_FORMAT_D16_UNORM : VK_FORMAT_UNDEFINED;
 	gettimeofday(&vc.start_tv, NULL);
 
+	if (bench_alloc)
+	{
+		display_mode = DISPLAY_MODE_HEADLESS;
+		if (init_headless(&vc) == -1)
+		{
+			printf("failed to initialize headless rendering\n");
+			return 1;
+		}
+
+		run_alloc_bench(&vc);
+		finish_vk(&vc);
+		return 0;
+	}
+
+	if (bench_record)
+	{
+		if (record_threads == 0)
+		{
+			fprintf(stderr, "--bench-record needs --record-threads\n");
+			usage();
+		}
+
+		display_mode = DISPLAY_MODE_HEADLESS;
+		if (init_headless(&vc) == -1)
+		{
+			printf("failed to initialize headless rendering\n");
+			return 1;
+		}
+
+		run_record_bench(&vc);
+		finish_vk(&vc);
+		return 0;
+	}
+
+	if (display_mode == DISPLAY_MODE_HEADLESS)
+	{
+		if (resize_storm.resizes > 0)
+		{
+			fprintf(stderr, "--resize-storm needs a window\n");
+			usage();
+		}
+
+		if (init_headless(&vc) == -1)
+		{
+			printf("failed to initialize headless rendering\n");
+			return 1;
+		}
+
+		mainloop_headless(&vc);
+		finish_vk(&vc);
+		return 0;
+	}
+
 	if (init_xcb(&vc) == -1)
 	{
 		printf("failed to initialize xcb\n");
@@ -838,5 +3142,10 @@ int main(int argc, char *argv[])
 	printf("ok");
 	mainloop_xcb(&vc);
 
+	if (vc.device != VK_NULL_HANDLE)
+	{
+		finish_vk(&vc);
+	}
+
 	return 0;
 }
\ No newline at end of file
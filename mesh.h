@@ -0,0 +1,697 @@
+/* Mesh loading.
+ *
+ * mesh_load() reads a Wavefront OBJ or binary STL file into a struct mesh
+ * whose arrays it owns. Face corners are deduplicated into shared vertices
+ * through a hash table keyed on what identifies a vertex in the file: the
+ * position and normal indices for OBJ, the position bits for STL. Polygons are
+ * split into triangle fans.
+ *
+ * Normals the file does not give are smoothed from the area-weighted normals
+ * of the triangles around each vertex, and colors it does not give are
+ * derived from the normal. The result is centered and scaled to the cube's
+ * [-1, 1] bounds so it fits the same view.
+ *
+ * mesh_save() writes a loaded mesh in the .vkmesh format below, which
+ * mesh_load() maps instead of parsing: its arrays point straight into the
+ * file mapping.
+ */
+
+#include <strings.h>
+
+/* Indexed triangle list with one float3 position, color and normal per
+ * vertex, each attribute in its own array.
+ */
+struct mesh {
+   uint32_t vertex_count;
+   const float *positions;
+   const float *colors;
+   const float *normals;
+
+   uint32_t index_count;
+   const uint32_t *indices;
+
+   /* file mapping the arrays point into, NULL if they were allocated */
+   void *mapping;
+   size_t mapping_size;
+};
+
+/* what the file gave for a vertex */
+#define MESH_VERTEX_NORMAL (1 << 0)
+#define MESH_VERTEX_COLOR  (1 << 1)
+
+struct mesh_builder {
+   uint32_t vertex_count, vertex_capacity;
+   float *positions, *colors, *normals;
+   uint8_t *flags;
+   uint32_t (*keys)[3];
+
+   uint32_t index_count, index_capacity;
+   uint32_t *indices;
+
+   /* Open addressing, vertex index + 1 or 0 for an empty slot. */
+   uint32_t *table;
+   uint32_t table_mask;
+};
+
+static void *
+mesh_realloc(void *p, size_t size)
+{
+   p = realloc(p, size);
+   if (!p) {
+      fprintf(stderr, "out of memory\n");
+      abort();
+   }
+
+   return p;
+}
+
+static void *
+mesh_calloc(size_t count, size_t size)
+{
+   void *p = calloc(count, size);
+   if (!p && count > 0) {
+      fprintf(stderr, "out of memory\n");
+      abort();
+   }
+
+   return p;
+}
+
+/* Grow array to hold at least count elements of size bytes. */
+static void *
+mesh_reserve(void *array, uint32_t *capacity, uint64_t count, size_t size)
+{
+   if (count <= *capacity)
+      return array;
+
+   uint64_t new_capacity = *capacity ? *capacity : 1024;
+   while (new_capacity < count)
+      new_capacity *= 2;
+   if (new_capacity > UINT32_MAX) {
+      fprintf(stderr, "mesh too large\n");
+      abort();
+   }
+
+   *capacity = new_capacity;
+   return mesh_realloc(array, new_capacity * size);
+}
+
+static inline uint32_t
+mesh_hash(const uint32_t key[3])
+{
+   uint32_t h = key[0] * 0x9e3779b1u;
+
+   h = (h ^ (h >> 15) ^ key[1]) * 0x85ebca77u;
+   h = (h ^ (h >> 13) ^ key[2]) * 0xc2b2ae3du;
+   return h ^ (h >> 16);
+}
+
+static void
+mesh_rehash(struct mesh_builder *b, uint32_t size)
+{
+   free(b->table);
+   b->table = mesh_realloc(NULL, size * sizeof(*b->table));
+   memset(b->table, 0, size * sizeof(*b->table));
+   b->table_mask = size - 1;
+
+   for (uint32_t v = 0; v < b->vertex_count; v++) {
+      uint32_t slot = mesh_hash(b->keys[v]) & b->table_mask;
+
+      while (b->table[slot])
+         slot = (slot + 1) & b->table_mask;
+      b->table[slot] = v + 1;
+   }
+}
+
+/* Return the vertex for key, adding it with the given attributes if it is
+ * new. normal and color may be NULL.
+ */
+static uint32_t
+mesh_add_vertex(struct mesh_builder *b, const uint32_t key[3], const float position[3],
+                const float normal[3], const float color[3])
+{
+   uint32_t slot = mesh_hash(key) & b->table_mask;
+
+   for (; b->table[slot]; slot = (slot + 1) & b->table_mask) {
+      uint32_t v = b->table[slot] - 1;
+
+      if (memcmp(b->keys[v], key, sizeof(b->keys[v])) == 0)
+         return v;
+   }
+
+   if (b->vertex_count == b->vertex_capacity) {
+      if (b->vertex_capacity > UINT32_MAX / 4) {
+         fprintf(stderr, "mesh too large\n");
+         abort();
+      }
+      b->vertex_capacity = b->vertex_capacity ? b->vertex_capacity * 2 : 1024;
+      b->positions = mesh_realloc(b->positions, b->vertex_capacity * 3 * sizeof(float));
+      b->colors = mesh_realloc(b->colors, b->vertex_capacity * 3 * sizeof(float));
+      b->normals = mesh_realloc(b->normals, b->vertex_capacity * 3 * sizeof(float));
+      b->flags = mesh_realloc(b->flags, b->vertex_capacity * sizeof(*b->flags));
+      b->keys = mesh_realloc(b->keys, b->vertex_capacity * sizeof(*b->keys));
+   }
+
+   uint32_t v = b->vertex_count++;
+
+   memcpy(b->keys[v], key, sizeof(b->keys[v]));
+   memcpy(&b->positions[v * 3], position, 3 * sizeof(float));
+   memcpy(&b->normals[v * 3], normal ? normal : (float[3]) { 0 }, 3 * sizeof(float));
+   memcpy(&b->colors[v * 3], color ? color : (float[3]) { 0 }, 3 * sizeof(float));
+   b->flags[v] = (normal ? MESH_VERTEX_NORMAL : 0) | (color ? MESH_VERTEX_COLOR : 0);
+
+   b->table[slot] = v + 1;
+   if (b->vertex_count * 2 > b->table_mask)
+      mesh_rehash(b, (b->table_mask + 1) * 2);
+
+   return v;
+}
+
+static void
+mesh_add_triangle(struct mesh_builder *b, uint32_t v0, uint32_t v1, uint32_t v2)
+{
+   b->indices = mesh_reserve(b->indices, &b->index_capacity, (uint64_t) b->index_count + 3,
+                             sizeof(uint32_t));
+   b->indices[b->index_count++] = v0;
+   b->indices[b->index_count++] = v1;
+   b->indices[b->index_count++] = v2;
+}
+
+/* Fill in missing normals and colors, fit the mesh into [-1, 1] and hand
+ * the arrays over to mesh.
+ */
+static void
+mesh_builder_finish(struct mesh_builder *b, struct mesh *mesh)
+{
+   float *p = b->positions, *n = b->normals;
+
+   /* The cross product's length is twice the triangle's area. */
+   for (uint32_t i = 0; i < b->index_count; i += 3) {
+      uint32_t v0 = b->indices[i], v1 = b->indices[i + 1], v2 = b->indices[i + 2];
+      float e1[3], e2[3];
+
+      for (int c = 0; c < 3; c++) {
+         e1[c] = p[v1 * 3 + c] - p[v0 * 3 + c];
+         e2[c] = p[v2 * 3 + c] - p[v0 * 3 + c];
+      }
+
+      float face[3] = {
+         e1[1] * e2[2] - e1[2] * e2[1],
+         e1[2] * e2[0] - e1[0] * e2[2],
+         e1[0] * e2[1] - e1[1] * e2[0],
+      };
+
+      for (int k = 0; k < 3; k++) {
+         uint32_t v = b->indices[i + k];
+
+         if (!(b->flags[v] & MESH_VERTEX_NORMAL)) {
+            for (int c = 0; c < 3; c++)
+               n[v * 3 + c] += face[c];
+         }
+      }
+   }
+
+   float min[3] = { INFINITY, INFINITY, INFINITY };
+   float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+   for (uint32_t v = 0; v < b->vertex_count; v++) {
+      float *normal = &n[v * 3];
+      float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+      if (length > 0.0f) {
+         for (int c = 0; c < 3; c++)
+            normal[c] /= length;
+      } else {
+         memcpy(normal, (float[3]) { 0.0f, 0.0f, 1.0f }, 3 * sizeof(float));
+      }
+
+      if (!(b->flags[v] & MESH_VERTEX_COLOR)) {
+         for (int c = 0; c < 3; c++)
+            b->colors[v * 3 + c] = normal[c] * 0.5f + 0.5f;
+      }
+
+      for (int c = 0; c < 3; c++) {
+         min[c] = fminf(min[c], p[v * 3 + c]);
+         max[c] = fmaxf(max[c], p[v * 3 + c]);
+      }
+   }
+
+   float extent = fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+   float scale = extent > 0.0f ? 2.0f / extent : 1.0f;
+
+   for (uint32_t v = 0; v < b->vertex_count; v++) {
+      for (int c = 0; c < 3; c++)
+         p[v * 3 + c] = (p[v * 3 + c] - (min[c] + max[c]) * 0.5f) * scale;
+   }
+
+   free(b->flags);
+   free(b->keys);
+   free(b->table);
+
+   *mesh = (struct mesh) {
+      .vertex_count = b->vertex_count,
+      .positions = b->positions,
+      .colors = b->colors,
+      .normals = b->normals,
+      .index_count = b->index_count,
+      .indices = b->indices,
+   };
+}
+
+static void
+mesh_builder_abort(struct mesh_builder *b)
+{
+   free(b->positions);
+   free(b->colors);
+   free(b->normals);
+   free(b->flags);
+   free(b->keys);
+   free(b->indices);
+   free(b->table);
+}
+
+/* Read all of path, NUL-terminated. */
+static char *
+mesh_read_file(const char *path, size_t *size)
+{
+   FILE *f = fopen(path, "rb");
+   char *data = NULL;
+   long length;
+
+   if (!f) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return NULL;
+   }
+
+   if (fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) >= 0 &&
+       fseek(f, 0, SEEK_SET) == 0 && (data = malloc(length + 1)) &&
+       fread(data, 1, length, f) == (size_t) length) {
+      data[length] = '\0';
+      *size = length;
+   } else {
+      fprintf(stderr, "%s: failed to read file\n", path);
+      free(data);
+      data = NULL;
+   }
+
+   fclose(f);
+   return data;
+}
+
+/* Parse up to count floats from *s, returning how many were found. */
+static int
+mesh_parse_floats(char **s, float *out, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++) {
+      char *end;
+      float value = strtof(*s, &end);
+
+      if (end == *s)
+         break;
+      out[i] = value;
+      *s = end;
+   }
+
+   return i;
+}
+
+/* Resolve a 1-based or negative (relative to the end) OBJ index into [0,
+ * count), or return false.
+ */
+static bool
+mesh_obj_index(long index, uint32_t count, uint32_t *out)
+{
+   if (index > 0 && index <= count)
+      *out = index - 1;
+   else if (index < 0 && -index <= count)
+      *out = count + index;
+   else
+      return false;
+
+   return true;
+}
+
+/* Positions with optional vertex colors ("v x y z r g b"), normals and
+ * faces; texture coordinates and everything else are ignored.
+ */
+static bool
+mesh_load_obj(const char *path, struct mesh_builder *b)
+{
+   size_t size;
+   char *data = mesh_read_file(path, &size);
+   float *positions = NULL, *colors = NULL, *normals = NULL;
+   uint32_t position_count = 0, position_capacity = 0, color_capacity = 0;
+   uint32_t normal_count = 0, normal_capacity = 0;
+   bool ok = true;
+   uint32_t line = 0;
+
+   if (!data)
+      return false;
+
+   for (char *s = data, *next; ok && *s; s = next) {
+      next = s + strcspn(s, "\n");
+      if (*next)
+         *next++ = '\0';
+      line++;
+
+      s += strspn(s, " \t");
+
+      if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+         float v[6];
+         int count;
+
+         s += 2;
+         count = mesh_parse_floats(&s, v, 6);
+         if (count < 3) {
+            fprintf(stderr, "%s:%u: expected a position\n", path, line);
+            ok = false;
+            break;
+         }
+
+         positions = mesh_reserve(positions, &position_capacity, position_count + 1,
+                                  3 * sizeof(float));
+         colors = mesh_reserve(colors, &color_capacity, position_count + 1, 4 * sizeof(float));
+         memcpy(&positions[position_count * 3], v, 3 * sizeof(float));
+         /* The fourth float flags whether the vertex had a color. */
+         memcpy(&colors[position_count * 4], &v[3], 3 * sizeof(float));
+         colors[position_count * 4 + 3] = count == 6;
+         position_count++;
+      } else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+         s += 3;
+         normals = mesh_reserve(normals, &normal_capacity, normal_count + 1, 3 * sizeof(float));
+         if (mesh_parse_floats(&s, &normals[normal_count * 3], 3) < 3) {
+            fprintf(stderr, "%s:%u: expected a normal\n", path, line);
+            ok = false;
+            break;
+         }
+         normal_count++;
+      } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+         uint32_t first = 0, prev = 0, corners = 0;
+
+         s += 2;
+         for (;;) {
+            char *end;
+            long index = strtol(s, &end, 10);
+            uint32_t p, normal = UINT32_MAX;
+
+            if (end == s)
+               break;
+            if (!mesh_obj_index(index, position_count, &p)) {
+               fprintf(stderr, "%s:%u: position index %ld out of range\n", path, line, index);
+               ok = false;
+               break;
+            }
+            s = end;
+
+            /* v, v/vt, v//vn or v/vt/vn */
+            if (*s == '/') {
+               s++;
+               strtol(s, &end, 10);
+               s = end;
+               if (*s == '/') {
+                  s++;
+                  index = strtol(s, &end, 10);
+                  if (end == s || !mesh_obj_index(index, normal_count, &normal)) {
+                     fprintf(stderr, "%s:%u: bad normal index\n", path, line);
+                     ok = false;
+                     break;
+                  }
+                  s = end;
+               }
+            }
+
+            uint32_t key[3] = { p, normal, 0 };
+            uint32_t v = mesh_add_vertex(b, key, &positions[p * 3],
+                                         normal != UINT32_MAX ? &normals[normal * 3] : NULL,
+                                         colors[p * 4 + 3] != 0.0f ? &colors[p * 4] : NULL);
+
+            if (corners == 0)
+               first = v;
+            else if (corners >= 2)
+               mesh_add_triangle(b, first, prev, v);
+            prev = v;
+            corners++;
+         }
+
+         if (ok && corners < 3) {
+            fprintf(stderr, "%s:%u: face with fewer than 3 corners\n", path, line);
+            ok = false;
+         }
+      }
+   }
+
+   free(positions);
+   free(colors);
+   free(normals);
+   free(data);
+
+   return ok;
+}
+
+/* Binary STL: an 80 byte header, a triangle count and 50 bytes per triangle
+ * of a face normal, three corners and an attribute word. Corners are shared
+ * by position and the face normals are ignored in favour of smooth ones.
+ */
+static bool
+mesh_load_stl(const char *path, struct mesh_builder *b)
+{
+   size_t size;
+   char *data = mesh_read_file(path, &size);
+   uint32_t count;
+
+   if (!data)
+      return false;
+
+   if (size < 84 || (memcpy(&count, data + 80, sizeof(count)), size != 84 + 50ull * count)) {
+      fprintf(stderr, "%s: not a binary STL file%s\n", path,
+              strncmp(data, "solid", 5) == 0 ? " (ASCII STL is not supported)" : "");
+      free(data);
+      return false;
+   }
+
+   for (uint32_t t = 0; t < count; t++) {
+      const char *triangle = data + 84 + 50 * t;
+      uint32_t v[3];
+
+      for (int k = 0; k < 3; k++) {
+         float position[3];
+         uint32_t key[3];
+
+         memcpy(position, triangle + 12 + 12 * k, sizeof(position));
+         /* -0.0 and 0.0 are the same position */
+         for (int c = 0; c < 3; c++)
+            position[c] += 0.0f;
+         memcpy(key, position, sizeof(key));
+
+         v[k] = mesh_add_vertex(b, key, position, NULL, NULL);
+      }
+
+      mesh_add_triangle(b, v[0], v[1], v[2]);
+   }
+
+   free(data);
+   return true;
+}
+
+/* .vkmesh: a header followed by the vertex section, the positions, colors
+ * and normals as float3 arrays back to back, and the uint32_t indices. Both
+ * sections start MESH_FILE_ALIGN aligned, so once mapped the vertex section
+ * is the separate vertex layout as is. Data is in host byte order, files
+ * from a host of the other byte order fail the version check.
+ */
+#define MESH_FILE_MAGIC "vkmesh\r\n"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGN 64
+
+struct mesh_file_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t vertex_count;
+   uint32_t index_count;
+   uint32_t pad;
+   /* from the start of the file */
+   uint64_t vertex_offset;
+   uint64_t index_offset;
+   uint64_t file_size;
+};
+
+static inline uint64_t
+mesh_file_align(uint64_t offset)
+{
+   return (offset + MESH_FILE_ALIGN - 1) & ~(uint64_t) (MESH_FILE_ALIGN - 1);
+}
+
+static bool
+mesh_save(const char *path, const struct mesh *mesh)
+{
+   uint64_t vertex_bytes = (uint64_t) mesh->vertex_count * 3 * sizeof(float);
+   struct mesh_file_header header = {
+      .magic = MESH_FILE_MAGIC,
+      .version = MESH_FILE_VERSION,
+      .vertex_count = mesh->vertex_count,
+      .index_count = mesh->index_count,
+      .vertex_offset = mesh_file_align(sizeof(header)),
+   };
+   static const char zeros[MESH_FILE_ALIGN];
+   FILE *f = fopen(path, "wb");
+   bool ok;
+
+   header.index_offset = mesh_file_align(header.vertex_offset + 3 * vertex_bytes);
+   header.file_size = header.index_offset + (uint64_t) mesh->index_count * sizeof(uint32_t);
+
+   if (!f) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(zeros, header.vertex_offset - sizeof(header), 1, f) == 1 &&
+        fwrite(mesh->positions, 1, vertex_bytes, f) == vertex_bytes &&
+        fwrite(mesh->colors, 1, vertex_bytes, f) == vertex_bytes &&
+        fwrite(mesh->normals, 1, vertex_bytes, f) == vertex_bytes &&
+        fwrite(zeros, 1, header.index_offset - header.vertex_offset - 3 * vertex_bytes, f) ==
+           header.index_offset - header.vertex_offset - 3 * vertex_bytes &&
+        fwrite(mesh->indices, sizeof(uint32_t), mesh->index_count, f) == mesh->index_count;
+
+   if (fclose(f) != 0)
+      ok = false;
+   if (!ok) {
+      fprintf(stderr, "%s: failed to write mesh\n", path);
+      unlink(path);
+   }
+
+   return ok;
+}
+
+/* Map a .vkmesh file. Only the header is checked and the indices bounded;
+ * the vertex data is used as is.
+ */
+static bool
+mesh_map(const char *path, struct mesh *mesh)
+{
+   struct mesh_file_header header;
+   struct stat st;
+   void *map;
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+   if (fd < 0) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header) ||
+       (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      fprintf(stderr, "%s: failed to map mesh\n", path);
+      close(fd);
+      return false;
+   }
+   close(fd);
+
+   memcpy(&header, map, sizeof(header));
+
+   /* Neither can overflow with 32 bit counts. Offsets come from the file,
+    * so each is bounded by file_size before anything is added to it.
+    */
+   uint64_t vertex_bytes = (uint64_t) header.vertex_count * 3 * sizeof(float);
+   uint64_t index_bytes = (uint64_t) header.index_count * sizeof(uint32_t);
+   if (memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != MESH_FILE_VERSION ||
+       header.file_size != (uint64_t) st.st_size ||
+       header.vertex_offset % MESH_FILE_ALIGN != 0 || header.index_offset % MESH_FILE_ALIGN != 0 ||
+       header.vertex_offset < sizeof(header) ||
+       header.vertex_offset > header.file_size ||
+       3 * vertex_bytes > header.file_size - header.vertex_offset ||
+       header.index_offset < header.vertex_offset + 3 * vertex_bytes ||
+       header.index_offset > header.file_size ||
+       index_bytes > header.file_size - header.index_offset ||
+       header.index_count == 0 || header.index_count % 3 != 0) {
+      fprintf(stderr, "%s: not a version %u .vkmesh file\n", path, MESH_FILE_VERSION);
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   const float *vertices = (const float *) ((char *) map + header.vertex_offset);
+   const uint32_t *indices = (const uint32_t *) ((char *) map + header.index_offset);
+
+   /* The one pass over the data: an out of range index would make the GPU
+    * read outside the vertex buffer.
+    */
+   uint32_t max_index = 0;
+   for (uint32_t i = 0; i < header.index_count; i++)
+      max_index = indices[i] > max_index ? indices[i] : max_index;
+   if (max_index >= header.vertex_count) {
+      fprintf(stderr, "%s: index %u out of range\n", path, max_index);
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   *mesh = (struct mesh) {
+      .vertex_count = header.vertex_count,
+      .positions = vertices,
+      .colors = vertices + header.vertex_count * 3,
+      .normals = vertices + header.vertex_count * 6,
+      .index_count = header.index_count,
+      .indices = indices,
+      .mapping = map,
+      .mapping_size = st.st_size,
+   };
+
+   return true;
+}
+
+/* Load path by its extension, .obj, .stl or .vkmesh. Prints the reason and
+ * returns false on failure.
+ */
+static bool
+mesh_load(const char *path, struct mesh *mesh)
+{
+   struct mesh_builder b = { 0 };
+   const char *ext = strrchr(path, '.');
+   bool ok;
+
+   if (ext && strcasecmp(ext, ".vkmesh") == 0)
+      return mesh_map(path, mesh);
+
+   mesh_rehash(&b, 1024);
+
+   if (ext && strcasecmp(ext, ".obj") == 0) {
+      ok = mesh_load_obj(path, &b);
+   } else if (ext && strcasecmp(ext, ".stl") == 0) {
+      ok = mesh_load_stl(path, &b);
+   } else {
+      fprintf(stderr, "%s: unknown mesh format, expected .obj, .stl or .vkmesh\n", path);
+      ok = false;
+   }
+
+   if (ok && b.index_count == 0) {
+      fprintf(stderr, "%s: no triangles\n", path);
+      ok = false;
+   }
+
+   if (!ok) {
+      mesh_builder_abort(&b);
+      return false;
+   }
+
+   mesh_builder_finish(&b, mesh);
+   return true;
+}
+
+/* Free the arrays or unmap the file of a mesh from mesh_load(). */
+static void
+mesh_free(struct mesh *mesh)
+{
+   if (mesh->mapping) {
+      munmap(mesh->mapping, mesh->mapping_size);
+      memset(mesh, 0, sizeof(*mesh));
+      return;
+   }
+
+   free((void *) mesh->positions);
+   free((void *) mesh->colors);
+   free((void *) mesh->normals);
+   free((void *) mesh->indices);
+   memset(mesh, 0, sizeof(*mesh));
+}
@@ -0,0 +1,360 @@
+/* Index and vertex order optimization for loaded meshes.
+ *
+ * Triangles are reordered for the post-transform vertex cache with Tipsify
+ * (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality
+ * and Reduced Overdraw", 2007), which fans around vertices still in a
+ * simulated cache of MESH_CACHE_SIZE entries. Optionally the clusters it
+ * emits between cache flushes are then sorted so those facing outwards, which
+ * tend to occlude the rest, are drawn first. Finally vertices are renumbered
+ * in order of first use, so vertex fetch walks the buffers front to back, and
+ * unreferenced vertices are dropped.
+ *
+ * The quality measure is the average cache miss ratio (ACMR): vertex shader
+ * invocations per triangle with a FIFO cache of MESH_CACHE_SIZE, between 0.5
+ * for an ideal ordering of a large regular mesh and 3 for none.
+ */
+
+#define MESH_CACHE_SIZE 16
+
+enum mesh_optimize {
+   MESH_OPTIMIZE_NONE,
+   /* Tipsify and vertex fetch order */
+   MESH_OPTIMIZE_CACHE,
+   /* the above with clusters sorted to reduce overdraw */
+   MESH_OPTIMIZE_OVERDRAW,
+};
+
+static const char *const mesh_optimize_names[] = {
+   [MESH_OPTIMIZE_NONE] = "none",
+   [MESH_OPTIMIZE_CACHE] = "cache",
+   [MESH_OPTIMIZE_OVERDRAW] = "overdraw",
+};
+
+/* Transformed vertices per triangle with a FIFO cache of cache_size. */
+static float
+mesh_acmr(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count,
+          uint32_t cache_size)
+{
+   /* miss count at which each vertex last entered the cache, plus one */
+   uint32_t *entered = mesh_calloc(vertex_count, sizeof(*entered));
+   uint32_t misses = 0;
+
+   for (uint32_t i = 0; i < index_count; i++) {
+      uint32_t v = indices[i];
+
+      if (entered[v] == 0 || misses - (entered[v] - 1) >= cache_size)
+         entered[v] = ++misses;
+   }
+
+   free(entered);
+   return index_count ? (float) misses / (index_count / 3) : 0.0f;
+}
+
+struct mesh_tipsify {
+   /* triangles around each vertex: adjacency[offsets[v]] onwards */
+   uint32_t *offsets, *adjacency;
+   /* live (not yet emitted) triangles per vertex */
+   uint32_t *live;
+   /* time each vertex entered the simulated cache */
+   uint32_t *cache_time;
+   uint32_t time;
+   /* vertices of recently emitted triangles, to restart from at dead ends */
+   uint32_t *dead_end;
+   uint32_t dead_end_count;
+   /* next vertex to try once dead_end is empty */
+   uint32_t cursor;
+};
+
+/* Pick the next vertex to fan around: of the candidates, the one staying
+ * longest in the cache after its live triangles are emitted. Falls back to
+ * recently used vertices, then to the input order, returning -1 when every
+ * triangle is emitted. *flushed is set if no candidate was usable.
+ */
+static int64_t
+mesh_tipsify_next(struct mesh_tipsify *t, const uint32_t *candidates, uint32_t candidate_count,
+                  uint32_t vertex_count, uint32_t cache_size, bool *flushed)
+{
+   int64_t best = -1;
+   int64_t best_priority = -1;
+
+   for (uint32_t i = 0; i < candidate_count; i++) {
+      uint32_t v = candidates[i];
+      int64_t priority = 0;
+
+      if (t->live[v] == 0)
+         continue;
+
+      /* Fanning v adds up to 2 vertices per live triangle; if they would
+       * push v itself out of the cache, v is no better than a cold vertex.
+       */
+      if (t->time - t->cache_time[v] + 2 * t->live[v] <= cache_size)
+         priority = t->time - t->cache_time[v];
+
+      if (priority > best_priority) {
+         best = v;
+         best_priority = priority;
+      }
+   }
+
+   *flushed = best < 0;
+   if (best >= 0)
+      return best;
+
+   while (t->dead_end_count > 0) {
+      uint32_t v = t->dead_end[--t->dead_end_count];
+
+      if (t->live[v] > 0)
+         return v;
+   }
+
+   for (; t->cursor < vertex_count; t->cursor++) {
+      if (t->live[t->cursor] > 0)
+         return t->cursor;
+   }
+
+   return -1;
+}
+
+/* Write the triangles of indices in Tipsify order to out. If clusters is
+ * set, it receives the first triangle of each cluster, a run between cache
+ * flushes, and *cluster_count their number.
+ */
+static void
+mesh_tipsify(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count,
+             uint32_t cache_size, uint32_t *out, uint32_t *clusters, uint32_t *cluster_count)
+{
+   uint32_t triangle_count = index_count / 3;
+   struct mesh_tipsify t = {
+      .offsets = mesh_calloc(vertex_count + 1, sizeof(uint32_t)),
+      .adjacency = mesh_realloc(NULL, index_count * sizeof(uint32_t)),
+      .live = mesh_calloc(vertex_count, sizeof(uint32_t)),
+      .cache_time = mesh_calloc(vertex_count, sizeof(uint32_t)),
+      .time = cache_size + 1,
+      .dead_end = mesh_realloc(NULL, index_count * sizeof(uint32_t)),
+   };
+   bool *emitted = mesh_calloc(triangle_count, sizeof(bool));
+   uint32_t *candidates = mesh_realloc(NULL, index_count * sizeof(uint32_t));
+   uint32_t out_count = 0;
+
+   /* Counting sort of triangles by vertex. */
+   for (uint32_t i = 0; i < index_count; i++)
+      t.live[indices[i]]++;
+   for (uint32_t v = 0; v < vertex_count; v++)
+      t.offsets[v + 1] = t.offsets[v] + t.live[v];
+   for (uint32_t i = 0; i < index_count; i++)
+      t.adjacency[t.offsets[indices[i]]++] = i / 3;
+   for (uint32_t v = vertex_count; v > 0; v--)
+      t.offsets[v] = t.offsets[v - 1];
+   t.offsets[0] = 0;
+
+   if (cluster_count)
+      *cluster_count = 0;
+
+   bool flushed;
+   uint32_t candidate_count = 0;
+   int64_t f = mesh_tipsify_next(&t, NULL, 0, vertex_count, cache_size, &flushed);
+
+   while (f >= 0) {
+      if (flushed && clusters)
+         clusters[(*cluster_count)++] = out_count / 3;
+
+      candidate_count = 0;
+      for (uint32_t a = t.offsets[f]; a < t.offsets[f + 1]; a++) {
+         uint32_t triangle = t.adjacency[a];
+
+         if (emitted[triangle])
+            continue;
+         emitted[triangle] = true;
+
+         for (int k = 0; k < 3; k++) {
+            uint32_t v = indices[triangle * 3 + k];
+
+            out[out_count++] = v;
+            t.dead_end[t.dead_end_count++] = v;
+            candidates[candidate_count++] = v;
+            t.live[v]--;
+            if (t.time - t.cache_time[v] > cache_size)
+               t.cache_time[v] = t.time++;
+         }
+      }
+
+      f = mesh_tipsify_next(&t, candidates, candidate_count, vertex_count, cache_size, &flushed);
+   }
+
+   free(t.offsets);
+   free(t.adjacency);
+   free(t.live);
+   free(t.cache_time);
+   free(t.dead_end);
+   free(emitted);
+   free(candidates);
+}
+
+struct mesh_cluster {
+   uint32_t first, count;
+   /* area-weighted sum of triangle centroids, sum of triangle normals of
+    * length twice their area
+    */
+   float centroid[3], normal[3];
+   float area;
+   float sort_key;
+};
+
+static int
+mesh_compare_clusters(const void *a, const void *b)
+{
+   const struct mesh_cluster *ca = a, *cb = b;
+
+   /* descending */
+   return (ca->sort_key < cb->sort_key) - (ca->sort_key > cb->sort_key);
+}
+
+/* Reorder the clusters of indices by how far they face away from the
+ * centroid of the surface: the dot product of the cluster's centroid
+ * relative to it with the cluster's average normal. Outward facing clusters
+ * on the hull are drawn first, so more of what they hide fails the depth
+ * test.
+ */
+static void
+mesh_sort_clusters(const struct mesh *mesh, uint32_t *indices,
+                   const uint32_t *clusters, uint32_t cluster_count)
+{
+   uint32_t triangle_count = mesh->index_count / 3;
+   struct mesh_cluster *sorted = mesh_calloc(cluster_count, sizeof(*sorted));
+   float center[3] = { 0 }, area_sum = 0.0f;
+
+   for (uint32_t c = 0; c < cluster_count; c++) {
+      struct mesh_cluster *cluster = &sorted[c];
+
+      cluster->first = clusters[c];
+      cluster->count = (c + 1 < cluster_count ? clusters[c + 1] : triangle_count) - clusters[c];
+
+      for (uint32_t t = cluster->first; t < cluster->first + cluster->count; t++) {
+         const float *v[3];
+         float e1[3], e2[3];
+
+         for (int k = 0; k < 3; k++)
+            v[k] = &mesh->positions[indices[t * 3 + k] * 3];
+         for (int k = 0; k < 3; k++) {
+            e1[k] = v[1][k] - v[0][k];
+            e2[k] = v[2][k] - v[0][k];
+         }
+
+         float n[3] = {
+            e1[1] * e2[2] - e1[2] * e2[1],
+            e1[2] * e2[0] - e1[0] * e2[2],
+            e1[0] * e2[1] - e1[1] * e2[0],
+         };
+         float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+         for (int k = 0; k < 3; k++) {
+            cluster->centroid[k] += area * (v[0][k] + v[1][k] + v[2][k]) / 3.0f;
+            cluster->normal[k] += n[k];
+         }
+         cluster->area += area;
+      }
+
+      for (int k = 0; k < 3; k++)
+         center[k] += cluster->centroid[k];
+      area_sum += cluster->area;
+   }
+
+   for (int k = 0; k < 3; k++)
+      center[k] = area_sum > 0.0f ? center[k] / area_sum : 0.0f;
+
+   for (uint32_t c = 0; c < cluster_count; c++) {
+      struct mesh_cluster *cluster = &sorted[c];
+      const float *n = cluster->normal;
+      float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+      cluster->sort_key = 0.0f;
+      if (cluster->area > 0.0f && length > 0.0f) {
+         for (int k = 0; k < 3; k++)
+            cluster->sort_key += (cluster->centroid[k] / cluster->area - center[k]) * n[k] / length;
+      }
+   }
+
+   qsort(sorted, cluster_count, sizeof(*sorted), mesh_compare_clusters);
+
+   uint32_t *copy = mesh_realloc(NULL, mesh->index_count * sizeof(uint32_t));
+   uint32_t out = 0;
+
+   memcpy(copy, indices, mesh->index_count * sizeof(uint32_t));
+   for (uint32_t c = 0; c < cluster_count; c++) {
+      memcpy(&indices[out], &copy[sorted[c].first * 3], sorted[c].count * 3 * sizeof(uint32_t));
+      out += sorted[c].count * 3;
+   }
+
+   free(copy);
+   free(sorted);
+}
+
+/* Reorder the triangles of mesh for mode and renumber its vertices in order
+ * of first use. The mesh is replaced by one with allocated arrays, a mapped
+ * mesh is unmapped. Returns the ACMR before and after.
+ */
+static void
+mesh_optimize(struct mesh *mesh, enum mesh_optimize mode, float *acmr_before, float *acmr_after)
+{
+   uint32_t index_count = mesh->index_count, vertex_count = mesh->vertex_count;
+   uint32_t *indices = mesh_realloc(NULL, index_count * sizeof(uint32_t));
+
+   *acmr_before = mesh_acmr(mesh->indices, index_count, vertex_count, MESH_CACHE_SIZE);
+
+   if (mode == MESH_OPTIMIZE_NONE) {
+      *acmr_after = *acmr_before;
+      free(indices);
+      return;
+   }
+
+   if (mode == MESH_OPTIMIZE_OVERDRAW) {
+      uint32_t *clusters = mesh_realloc(NULL, (index_count / 3) * sizeof(uint32_t));
+      uint32_t cluster_count;
+
+      mesh_tipsify(mesh->indices, index_count, vertex_count, MESH_CACHE_SIZE,
+                   indices, clusters, &cluster_count);
+      mesh_sort_clusters(mesh, indices, clusters, cluster_count);
+      free(clusters);
+   } else {
+      mesh_tipsify(mesh->indices, index_count, vertex_count, MESH_CACHE_SIZE,
+                   indices, NULL, NULL);
+   }
+
+   /* Vertex fetch order: renumber in order of first use. */
+   uint32_t *remap = mesh_realloc(NULL, vertex_count * sizeof(uint32_t));
+   uint32_t used = 0;
+
+   memset(remap, 0xff, vertex_count * sizeof(uint32_t));
+   for (uint32_t i = 0; i < index_count; i++) {
+      if (remap[indices[i]] == UINT32_MAX)
+         remap[indices[i]] = used++;
+      indices[i] = remap[indices[i]];
+   }
+
+   float *positions = mesh_realloc(NULL, (size_t) used * 3 * sizeof(float));
+   float *colors = mesh_realloc(NULL, (size_t) used * 3 * sizeof(float));
+   float *normals = mesh_realloc(NULL, (size_t) used * 3 * sizeof(float));
+
+   for (uint32_t v = 0; v < vertex_count; v++) {
+      uint32_t n = remap[v];
+
+      if (n == UINT32_MAX)
+         continue;
+      memcpy(&positions[n * 3], &mesh->positions[v * 3], 3 * sizeof(float));
+      memcpy(&colors[n * 3], &mesh->colors[v * 3], 3 * sizeof(float));
+      memcpy(&normals[n * 3], &mesh->normals[v * 3], 3 * sizeof(float));
+   }
+   free(remap);
+
+   mesh_free(mesh);
+   *mesh = (struct mesh) {
+      .vertex_count = used,
+      .positions = positions,
+      .colors = colors,
+      .normals = normals,
+      .index_count = index_count,
+      .indices = indices,
+   };
+
+   *acmr_after = mesh_acmr(indices, index_count, used, MESH_CACHE_SIZE);
+}
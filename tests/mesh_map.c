@@ -0,0 +1,118 @@
+/* mesh_map() must accept what mesh_save() writes and reject truncated files
+ * and headers whose offsets or counts point outside the file.
+ *
+ *    gcc -O2 -I. tests/mesh_map.c -lm -o mesh_map_test && ./mesh_map_test
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mesh.h"
+
+static char path[] = "/tmp/mesh_map_test-XXXXXX.vkmesh";
+static int failures;
+
+/* Write size bytes of data to path and check whether mesh_map() takes it. */
+static void
+check(const char *name, const void *data, size_t size, bool valid)
+{
+   struct mesh mesh;
+   FILE *f = fopen(path, "wb");
+
+   if (!f || fwrite(data, 1, size, f) != size || fclose(f) != 0) {
+      fprintf(stderr, "%s: failed to write %s\n", name, path);
+      exit(1);
+   }
+
+   bool ok = mesh_map(path, &mesh);
+   if (ok)
+      mesh_free(&mesh);
+
+   printf("%-32s %s\n", name, ok == valid ? "ok" : "FAIL");
+   if (ok != valid)
+      failures++;
+}
+
+int
+main(void)
+{
+   static const float positions[] = { 0, 0, 0, 1, 0, 0, 0, 1, 0 };
+   static const float colors[] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+   static const float normals[] = { 0, 0, 1, 0, 0, 1, 0, 0, 1 };
+   static const uint32_t indices[] = { 0, 1, 2 };
+   const struct mesh triangle = {
+      .vertex_count = 3,
+      .positions = positions,
+      .colors = colors,
+      .normals = normals,
+      .index_count = 3,
+      .indices = indices,
+   };
+   struct mesh_file_header header;
+   int fd = mkstemps(path, strlen(".vkmesh"));
+
+   if (fd < 0 || !mesh_save(path, &triangle)) {
+      fprintf(stderr, "failed to write %s\n", path);
+      return 1;
+   }
+   close(fd);
+
+   /* The file as saved, to craft the others from. */
+   FILE *f = fopen(path, "rb");
+   fseek(f, 0, SEEK_END);
+   size_t size = ftell(f);
+   char *saved = malloc(size), *data = malloc(size);
+   fseek(f, 0, SEEK_SET);
+   if (fread(saved, 1, size, f) != size) {
+      fprintf(stderr, "failed to read %s\n", path);
+      return 1;
+   }
+   fclose(f);
+   memcpy(&header, saved, sizeof(header));
+
+#define CRAFT(field, value) \
+   do { \
+      struct mesh_file_header h = header; \
+      h.field = (value); \
+      memcpy(data, saved, size); \
+      memcpy(data, &h, sizeof(h)); \
+   } while (0)
+
+   check("as saved", saved, size, true);
+   check("empty", saved, 0, false);
+   check("header only", saved, sizeof(header), false);
+   check("truncated indices", saved, size - 4, false);
+
+   CRAFT(vertex_offset, UINT64_MAX - MESH_FILE_ALIGN + 1);
+   check("vertex_offset near UINT64_MAX", data, size, false);
+   CRAFT(vertex_offset, header.file_size);
+   check("vertex_offset at file end", data, size, false);
+   CRAFT(vertex_count, UINT32_MAX);
+   check("vertex_count past file end", data, size, false);
+   CRAFT(index_offset, UINT64_MAX - MESH_FILE_ALIGN + 1);
+   check("index_offset near UINT64_MAX", data, size, false);
+   CRAFT(index_count, UINT32_MAX / 3 * 3);
+   check("index_count past file end", data, size, false);
+   CRAFT(file_size, size + MESH_FILE_ALIGN);
+   check("file_size mismatch", data, size, false);
+   CRAFT(version, MESH_FILE_VERSION + 1);
+   check("unknown version", data, size, false);
+
+   memcpy(data, saved, size);
+   memcpy(data + header.index_offset + 8, &(uint32_t) { 3 }, sizeof(uint32_t));
+   check("index out of range", data, size, false);
+
+   unlink(path);
+   free(saved);
+   free(data);
+
+   return failures ? 1 : 0;
+}
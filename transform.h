@@ -0,0 +1,222 @@
+/* Batched transform update for many objects.
+ *
+ * Objects come in SoA layout: a position, a unit rotation axis and an angle
+ * in degrees each. For every object transform_update() writes the struct ubo
+ * the instanced vertex shader reads: the modelview, built like
+ * esTranslate(view, position) followed by esRotate(angle, axis), its product
+ * with the projection and the normal matrix. Results go straight to the
+ * destination, which may be a mapped buffer.
+ *
+ * TRANSFORM_WIDTH objects are handled per step with GCC vector extensions,
+ * which the compiler lowers to SSE, AVX or NEON for the target, and sin/cos
+ * come from a polynomial so the trig vectorizes too.
+ */
+
+#if defined(__AVX__)
+#define TRANSFORM_WIDTH 8
+#else
+#define TRANSFORM_WIDTH 4
+#endif
+
+typedef float vfloat __attribute__((vector_size(TRANSFORM_WIDTH * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(TRANSFORM_WIDTH * sizeof(int32_t))));
+typedef uint32_t vuint __attribute__((vector_size(TRANSFORM_WIDTH * sizeof(uint32_t))));
+
+struct transform_batch {
+   uint32_t count;
+   float *x, *y, *z;
+   float *axis_x, *axis_y, *axis_z;
+   float *angle;
+};
+
+static inline vfloat
+transform_load(const float *p)
+{
+   vfloat v;
+
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+/* sin and cos of degrees: reduce to [-45, 45] degrees around the nearest
+ * multiple of 90 and evaluate the Cephes sinf/cosf polynomials, good to a
+ * few ulp.
+ */
+static inline void
+transform_sincos(vfloat degrees, vfloat *s, vfloat *c)
+{
+   /* Adding and subtracting 1.5 * 2^23 rounds to the nearest integer. */
+   vfloat quadrant = degrees * (1.0f / 90.0f);
+   quadrant = (quadrant + 0x1.8p23f) - 0x1.8p23f;
+   vuint q = (vuint) __builtin_convertvector(quadrant, vint);
+
+   vfloat r = (degrees - quadrant * 90.0f) * (PI / 180.0f);
+   vfloat r2 = r * r;
+
+   vfloat ps = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+   vfloat pc = 1.0f - 0.5f * r2 +
+               r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+
+   /* Odd quadrants swap sin and cos, the sign follows the quadrant. */
+   vuint swap = -(q & 1);
+   vuint sin_bits = ((vuint) ps & ~swap) | ((vuint) pc & swap);
+   vuint cos_bits = ((vuint) pc & ~swap) | ((vuint) ps & swap);
+
+   *s = (vfloat) (sin_bits ^ ((q & 2) << 30));
+   *c = (vfloat) (cos_bits ^ (((q + 1) & 2) << 30));
+}
+
+/* e[j] holds element j of one matrix row for every object. Transpose in 4x4
+ * blocks and store each object's row at offset bytes into its struct ubo.
+ */
+static inline void
+transform_store_row(struct ubo *block, size_t offset, const vfloat e[4])
+{
+#if TRANSFORM_WIDTH == 8
+   vfloat t0 = __builtin_shuffle(e[0], e[1], (vint) { 0, 8, 1, 9, 4, 12, 5, 13 });
+   vfloat t1 = __builtin_shuffle(e[0], e[1], (vint) { 2, 10, 3, 11, 6, 14, 7, 15 });
+   vfloat t2 = __builtin_shuffle(e[2], e[3], (vint) { 0, 8, 1, 9, 4, 12, 5, 13 });
+   vfloat t3 = __builtin_shuffle(e[2], e[3], (vint) { 2, 10, 3, 11, 6, 14, 7, 15 });
+   vfloat r[4] = {
+      __builtin_shuffle(t0, t2, (vint) { 0, 1, 8, 9, 4, 5, 12, 13 }),
+      __builtin_shuffle(t0, t2, (vint) { 2, 3, 10, 11, 6, 7, 14, 15 }),
+      __builtin_shuffle(t1, t3, (vint) { 0, 1, 8, 9, 4, 5, 12, 13 }),
+      __builtin_shuffle(t1, t3, (vint) { 2, 3, 10, 11, 6, 7, 14, 15 }),
+   };
+
+   /* Objects l and l + 4 share r[l]. */
+   for (int l = 0; l < 4; l++) {
+      memcpy((char *) &block[l] + offset, &r[l], 4 * sizeof(float));
+      memcpy((char *) &block[l + 4] + offset, (float *) &r[l] + 4, 4 * sizeof(float));
+   }
+#else
+   vfloat t0 = __builtin_shuffle(e[0], e[1], (vint) { 0, 4, 1, 5 });
+   vfloat t1 = __builtin_shuffle(e[0], e[1], (vint) { 2, 6, 3, 7 });
+   vfloat t2 = __builtin_shuffle(e[2], e[3], (vint) { 0, 4, 1, 5 });
+   vfloat t3 = __builtin_shuffle(e[2], e[3], (vint) { 2, 6, 3, 7 });
+   vfloat r[4] = {
+      __builtin_shuffle(t0, t2, (vint) { 0, 1, 4, 5 }),
+      __builtin_shuffle(t0, t2, (vint) { 2, 3, 6, 7 }),
+      __builtin_shuffle(t1, t3, (vint) { 0, 1, 4, 5 }),
+      __builtin_shuffle(t1, t3, (vint) { 2, 3, 6, 7 }),
+   };
+
+   for (int l = 0; l < 4; l++)
+      memcpy((char *) &block[l] + offset, &r[l], 4 * sizeof(float));
+#endif
+}
+
+/* Update objects [begin, end). */
+static void
+transform_update_range(const struct transform_batch *batch,
+                       const ESMatrix *view, const ESMatrix *projection,
+                       struct ubo *out, uint32_t begin, uint32_t end)
+{
+   /* Local copies, out may alias anything as far as the compiler knows. */
+   const ESMatrix view_copy = *view, projection_copy = *projection;
+   const ESMatrix *v = &view_copy, *p = &projection_copy;
+
+   for (uint32_t base = begin; base < end; base += TRANSFORM_WIDTH) {
+      uint32_t n = end - base < TRANSFORM_WIDTH ? end - base : TRANSFORM_WIDTH;
+      vfloat x, y, z, ax, ay, az, angle;
+
+      if (n == TRANSFORM_WIDTH) {
+         x = transform_load(&batch->x[base]);
+         y = transform_load(&batch->y[base]);
+         z = transform_load(&batch->z[base]);
+         ax = transform_load(&batch->axis_x[base]);
+         ay = transform_load(&batch->axis_y[base]);
+         az = transform_load(&batch->axis_z[base]);
+         angle = transform_load(&batch->angle[base]);
+      } else {
+         /* Tail: pad with zeros, only n results are stored. */
+         float tail[7][TRANSFORM_WIDTH] = { { 0 } };
+
+         for (uint32_t l = 0; l < n; l++) {
+            tail[0][l] = batch->x[base + l];
+            tail[1][l] = batch->y[base + l];
+            tail[2][l] = batch->z[base + l];
+            tail[3][l] = batch->axis_x[base + l];
+            tail[4][l] = batch->axis_y[base + l];
+            tail[5][l] = batch->axis_z[base + l];
+            tail[6][l] = batch->angle[base + l];
+         }
+         x = transform_load(tail[0]);
+         y = transform_load(tail[1]);
+         z = transform_load(tail[2]);
+         ax = transform_load(tail[3]);
+         ay = transform_load(tail[4]);
+         az = transform_load(tail[5]);
+         angle = transform_load(tail[6]);
+      }
+
+      vfloat s, c;
+      transform_sincos(angle, &s, &c);
+
+      /* Rotation matrix as built by esRotate. */
+      vfloat oc = 1.0f - c;
+      vfloat xs = ax * s, ys = ay * s, zs = az * s;
+      vfloat rot[3][3] = {
+         { oc * ax * ax + c,  oc * ax * ay - zs, oc * az * ax + ys },
+         { oc * ax * ay + zs, oc * ay * ay + c,  oc * ay * az - xs },
+         { oc * az * ax - ys, oc * ay * az + xs, oc * az * az + c  },
+      };
+
+      /* modelview = rot * translate * view in ESMatrix row order. */
+      vfloat mv[4][4], mvp[4][4];
+      for (int j = 0; j < 4; j++) {
+         for (int i = 0; i < 3; i++)
+            mv[i][j] = rot[i][0] * v->m[0][j] + rot[i][1] * v->m[1][j] + rot[i][2] * v->m[2][j];
+         mv[3][j] = v->m[3][j] + x * v->m[0][j] + y * v->m[1][j] + z * v->m[2][j];
+      }
+
+      for (int i = 0; i < 4; i++) {
+         for (int j = 0; j < 4; j++)
+            mvp[i][j] = mv[i][0] * p->m[0][j] + mv[i][1] * p->m[1][j] +
+                        mv[i][2] * p->m[2][j] + mv[i][3] * p->m[3][j];
+      }
+
+      /* Transpose to one struct ubo per object, then store the block in
+       * one sequential write.
+       */
+      struct ubo block[TRANSFORM_WIDTH];
+      for (int i = 0; i < 4; i++) {
+         transform_store_row(block, offsetof(struct ubo, modelview) + i * 4 * sizeof(float), mv[i]);
+         transform_store_row(block, offsetof(struct ubo, modelviewprojection) + i * 4 * sizeof(float), mvp[i]);
+         if (i < 3)
+            transform_store_row(block, offsetof(struct ubo, normal) + i * 4 * sizeof(float), mv[i]);
+      }
+      memcpy(&out[base], block, n * sizeof(struct ubo));
+   }
+}
+
+struct transform_job {
+   const struct transform_batch *batch;
+   const ESMatrix *view, *projection;
+   struct ubo *out;
+};
+
+static void
+transform_worker(void *data, uint32_t index, uint32_t count)
+{
+   struct transform_job *job = data;
+   uint32_t begin, end;
+
+   worker_range(job->batch->count, index, count, TRANSFORM_WIDTH, &begin, &end);
+   transform_update_range(job->batch, job->view, job->projection, job->out, begin, end);
+}
+
+/* Update all objects of batch into out, split over the pool's threads. */
+static void
+transform_update(struct worker_pool *pool, const struct transform_batch *batch,
+                 const ESMatrix *view, const ESMatrix *projection, struct ubo *out)
+{
+   struct transform_job job = {
+      .batch = batch,
+      .view = view,
+      .projection = projection,
+      .out = out,
+   };
+
+   worker_pool_run(pool, transform_worker, &job);
+}
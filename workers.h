@@ -0,0 +1,137 @@
+/* Small persistent thread pool.
+ *
+ * worker_pool_run() runs one function on every thread of the pool, the
+ * calling thread included as index 0, and returns once all of them are done.
+ * Threads are created once and sleep on a condition variable in between, so
+ * running a job every frame costs two wake-ups rather than thread creation.
+ */
+
+#include <pthread.h>
+
+#define MAX_WORKERS 64
+
+typedef void (*worker_fn)(void *data, uint32_t index, uint32_t count);
+
+struct worker_pool;
+
+struct worker {
+   struct worker_pool *pool;
+   uint32_t index;
+   pthread_t thread;
+};
+
+struct worker_pool {
+   /* threads taking part in a job, including the caller */
+   uint32_t count;
+   struct worker workers[MAX_WORKERS];
+
+   pthread_mutex_t mutex;
+   pthread_cond_t start_cond;
+   pthread_cond_t done_cond;
+   uint64_t generation;
+   uint32_t pending;
+   bool quit;
+
+   worker_fn fn;
+   void *data;
+};
+
+static void *
+worker_main(void *arg)
+{
+   struct worker *worker = arg;
+   struct worker_pool *pool = worker->pool;
+   uint64_t generation = 0;
+
+   pthread_mutex_lock(&pool->mutex);
+   for (;;) {
+      while (pool->generation == generation && !pool->quit)
+         pthread_cond_wait(&pool->start_cond, &pool->mutex);
+      if (pool->quit)
+         break;
+      generation = pool->generation;
+      pthread_mutex_unlock(&pool->mutex);
+
+      pool->fn(pool->data, worker->index, pool->count);
+
+      pthread_mutex_lock(&pool->mutex);
+      if (--pool->pending == 0)
+         pthread_cond_signal(&pool->done_cond);
+   }
+   pthread_mutex_unlock(&pool->mutex);
+
+   return NULL;
+}
+
+static void
+worker_pool_init(struct worker_pool *pool, uint32_t count)
+{
+   memset(pool, 0, sizeof(*pool));
+   pool->count = count;
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->start_cond, NULL);
+   pthread_cond_init(&pool->done_cond, NULL);
+
+   for (uint32_t i = 1; i < count; i++) {
+      struct worker *worker = &pool->workers[i];
+
+      worker->pool = pool;
+      worker->index = i;
+      if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+         fprintf(stderr, "failed to start worker thread\n");
+         exit(1);
+      }
+   }
+}
+
+static void
+worker_pool_run(struct worker_pool *pool, worker_fn fn, void *data)
+{
+   if (pool->count <= 1) {
+      fn(data, 0, 1);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->mutex);
+   pool->fn = fn;
+   pool->data = data;
+   pool->pending = pool->count - 1;
+   pool->generation++;
+   pthread_cond_broadcast(&pool->start_cond);
+   pthread_mutex_unlock(&pool->mutex);
+
+   fn(data, 0, pool->count);
+
+   pthread_mutex_lock(&pool->mutex);
+   while (pool->pending > 0)
+      pthread_cond_wait(&pool->done_cond, &pool->mutex);
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+worker_pool_finish(struct worker_pool *pool)
+{
+   pthread_mutex_lock(&pool->mutex);
+   pool->quit = true;
+   pthread_cond_broadcast(&pool->start_cond);
+   pthread_mutex_unlock(&pool->mutex);
+
+   for (uint32_t i = 1; i < pool->count; i++)
+      pthread_join(pool->workers[i].thread, NULL);
+
+   pthread_mutex_destroy(&pool->mutex);
+   pthread_cond_destroy(&pool->start_cond);
+   pthread_cond_destroy(&pool->done_cond);
+}
+
+/* Split total items evenly over count workers, boundaries rounded down to a
+ * multiple of align.
+ */
+static inline void
+worker_range(uint32_t total, uint32_t index, uint32_t count, uint32_t align,
+             uint32_t *begin, uint32_t *end)
+{
+   *begin = (uint32_t) ((uint64_t) total * index / count) / align * align;
+   *end = index + 1 == count ? total :
+          (uint32_t) ((uint64_t) total * (index + 1) / count) / align * align;
+}